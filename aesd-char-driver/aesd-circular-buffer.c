@@ -34,52 +34,40 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     struct aesd_circular_buffer *buffer, size_t char_offset,
     size_t *entry_offset_byte_rtn) {
 
-  // handle empty buffer case
-  if (!buffer->full && buffer->in_offs == buffer->out_offs) {
+  // handle empty buffer case and positions past the end
+  if (char_offset >= aesd_circular_buffer_size(buffer)) {
     return NULL;
   }
 
+  // every entry records the running offset of its first byte, so the entry
+  // holding char_offset is the last one starting at or before it. Offsets are
+  // compared relative to bytes_out so that they may wrap around.
+  //
+  // < 4  > < 7    >
+  //
+  // str1\n|ne|x|str\n
+  // 0123   45|6|
+  //          |^|
+  //          |||
+  //        01|2| <-- char_offset - entry fpos
   struct aesd_buffer_entry *current_entry;
-  uint8_t index;
-  uint8_t buffer_index;
-  size_t sum_offsets = 0;
-  for (index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++) {
-    // if the sum offsets and the current entry size is greater than the
-    // char_offset, then the current entry is the correct one
-    // to look into and return
-    //
-    // for example
-    // entry1: str1, size:4
-    // entry2: nextstr, size:7
-    // if char_offset is 6
-    // sum_offsets + current_entry->size is 4, which is lte to char_offset
-    // if statement is false, sum_offsets is set to 4, go to next iter
-    // next iter, sum_offsets + current_entry->size is 11, > 6
-    // found the entry to return
-    // update the entry_offset_byte_rtn and return return_entry
-    //
-    // < 4  > < 7    >
-    //
-    // str1\n|ne|x|str\n
-    // 0123   45|6|
-    //          |^|
-    //          |||
-    //        01|2| <-- char_offset - sum_offsets
-
-
-    // use buffer_index so that all calls are relative to buffer->out_offs
-    buffer_index =
-        (index + buffer->out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    current_entry = &(buffer->entry[buffer_index]);
-    // handle zero reference with - 1
-    if (sum_offsets + current_entry->size - 1 >= char_offset) {
-      (*entry_offset_byte_rtn) = char_offset - sum_offsets;
-      return current_entry;
+  uint32_t low = 0;
+  uint32_t high = aesd_circular_buffer_count(buffer) - 1;
+  while (low < high) {
+    // round up so that low always advances
+    uint32_t mid = low + (high - low + 1) / 2;
+    current_entry = &buffer->entry[(buffer->out_offs + mid) & buffer->mask];
+    if (aesd_circular_buffer_entry_fpos(buffer, current_entry) <= char_offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
     }
-    sum_offsets += current_entry->size;
   }
 
-  return NULL;
+  current_entry = &buffer->entry[(buffer->out_offs + low) & buffer->mask];
+  (*entry_offset_byte_rtn) =
+      char_offset - aesd_circular_buffer_entry_fpos(buffer, current_entry);
+  return current_entry;
 }
 
 /**
@@ -106,20 +94,27 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
   // read the oldest value, so this function may be the only location
   // that the out_offs is modified
   if (buffer->full) {
-    replaced = buffer->entry[buffer->out_offs].buffptr;
-    buffer->out_offs =
-        ((buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    struct aesd_buffer_entry *oldest =
+        &buffer->entry[buffer->out_offs & buffer->mask];
+    replaced = oldest->buffptr;
+    buffer->bytes_out += oldest->size;
+    // with depth below capacity the slot is not the one written next, clear
+    // it so walking every slot does not find the replaced buffptr
+    memset(oldest, 0, sizeof(*oldest));
+    buffer->out_offs++;
+    buffer->evicted++;
   }
 
-  buffer->entry[buffer->in_offs] = *add_entry;
+  buffer->entry[buffer->in_offs & buffer->mask] = *add_entry;
+  buffer->entry[buffer->in_offs & buffer->mask].offset = buffer->bytes_in;
+  buffer->entry[buffer->in_offs & buffer->mask].seq = buffer->seq_in++;
+  buffer->bytes_in += add_entry->size;
 
-  buffer->in_offs =
-      ((buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+  // the offsets run freely and are only masked to index, their difference is
+  // the number of stored entries even after they wrap around
+  buffer->in_offs++;
 
-  // if the offsets are equal to each other, consider the buffer full
-  // this works because even if the initial offset values are both zero
-  // because before this check the in_offs is always incrememted
-  if (buffer->in_offs == buffer->out_offs) {
+  if (buffer->in_offs - buffer->out_offs == buffer->depth) {
     buffer->full = true;
   }
 
@@ -131,4 +126,141 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
  */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer) {
   memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+  buffer->entry = buffer->inline_entry;
+  buffer->capacity = AESDCHAR_INLINE_ENTRIES;
+  buffer->mask = AESDCHAR_INLINE_ENTRIES - 1;
+  buffer->depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+  buffer->seq_in = 1;
+}
+
+/**
+ * @return the number of entries stored in @param buffer
+ */
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer) {
+  return buffer->in_offs - buffer->out_offs;
+}
+
+/**
+ * @return the total number of bytes stored in @param buffer
+ */
+size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer) {
+  return buffer->bytes_in - buffer->bytes_out;
+}
+
+/**
+ * @return the position of the first byte of @param entry when all entries
+ * stored in @param buffer are concatenated end to end
+ */
+size_t
+aesd_circular_buffer_entry_fpos(const struct aesd_circular_buffer *buffer,
+                                const struct aesd_buffer_entry *entry) {
+  return entry->offset - buffer->bytes_out;
+}
+
+/**
+ * @return the entry @param index entries after the oldest one in @param
+ * buffer, or NULL if fewer entries are stored
+ */
+struct aesd_buffer_entry *
+aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+                              uint32_t index) {
+  if (index >= aesd_circular_buffer_count(buffer)) {
+    return NULL;
+  }
+  return &buffer->entry[(buffer->out_offs + index) & buffer->mask];
+}
+
+/**
+ * @return the sequence number of the oldest entry stored in @param buffer,
+ * buffer->seq_in if it is empty
+ */
+uint64_t
+aesd_circular_buffer_oldest_seq(const struct aesd_circular_buffer *buffer) {
+  return buffer->seq_in - aesd_circular_buffer_count(buffer);
+}
+
+/**
+ * @return the entry of @param buffer with sequence number @param seq, or NULL
+ * if it was dropped or not added yet
+ */
+struct aesd_buffer_entry *
+aesd_circular_buffer_find_seq(struct aesd_circular_buffer *buffer,
+                              uint64_t seq) {
+  uint64_t oldest = aesd_circular_buffer_oldest_seq(buffer);
+
+  // sequence numbers of stored entries are consecutive
+  if (seq < oldest || seq >= buffer->seq_in) {
+    return NULL;
+  }
+  return aesd_circular_buffer_entry_at(buffer, seq - oldest);
+}
+
+/**
+ * Drops the oldest entry of @param buffer. Any necessary locking must be
+ * handled by the caller.
+ * @return the buffptr of the dropped entry for the caller to free, NULL if
+ * the buffer was empty
+ */
+const char *
+aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer) {
+  if (aesd_circular_buffer_count(buffer) == 0) {
+    return NULL;
+  }
+  struct aesd_buffer_entry *oldest =
+      &buffer->entry[buffer->out_offs & buffer->mask];
+  const char *removed = oldest->buffptr;
+  buffer->bytes_out += oldest->size;
+  memset(oldest, 0, sizeof(*oldest));
+  buffer->out_offs++;
+  buffer->evicted++;
+  buffer->full = false;
+  return removed;
+}
+
+/**
+ * Moves the entries of @param buffer to @param entries, @param capacity
+ * slots (a power of two), and keeps up to @param depth entries from now on.
+ * Passing NULL for @param entries selects the inline storage, @param
+ * capacity is then ignored. Entries in excess of @param depth must have been
+ * dropped with aesd_circular_buffer_remove_oldest first. Any necessary
+ * locking must be handled by the caller.
+ * @return the storage used until now if the caller allocated it and must
+ * free it, NULL otherwise
+ */
+struct aesd_buffer_entry *
+aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+                            struct aesd_buffer_entry *entries,
+                            uint32_t capacity, uint32_t depth) {
+  struct aesd_buffer_entry *previous = buffer->entry;
+  uint32_t count = aesd_circular_buffer_count(buffer);
+  uint32_t index;
+
+  if (NULL == entries) {
+    entries = buffer->inline_entry;
+    capacity = AESDCHAR_INLINE_ENTRIES;
+  }
+
+  if (entries != previous) {
+    // copy out oldest first, so the new storage starts at slot 0
+    for (index = 0; index < count; index++) {
+      entries[index] = previous[(buffer->out_offs + index) & buffer->mask];
+    }
+    memset(&entries[count], 0, (capacity - count) * sizeof(*entries));
+    if (previous == buffer->inline_entry) {
+      memset(buffer->inline_entry, 0, sizeof(buffer->inline_entry));
+    }
+    buffer->entry = entries;
+    buffer->out_offs = 0;
+    buffer->in_offs = count;
+  }
+
+  buffer->capacity = capacity;
+  buffer->mask = capacity - 1;
+  buffer->depth = depth;
+  buffer->full = (count == depth);
+
+  if (previous == entries || previous == buffer->inline_entry) {
+    return NULL;
+  }
+  return previous;
 }
@@ -16,7 +16,15 @@
 #include <stdint.h> // uintx_t
 #endif
 
+/**
+ * Default number of entries kept, aesd_circular_buffer_resize changes it
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Entry slots held inside struct aesd_circular_buffer, a power of two large
+ * enough for the default depth, deeper rings use separate storage
+ */
+#define AESDCHAR_INLINE_ENTRIES 16
 
 struct aesd_buffer_entry {
   /**
@@ -27,27 +35,80 @@ struct aesd_buffer_entry {
    * Number of bytes stored in buffptr
    */
   size_t size;
+  /**
+   * CRC32C of the bytes in buffptr, only set when the driver is loaded with
+   * entry_crc=1, 0 otherwise
+   */
+  uint32_t crc;
+  /**
+   * Value of the buffer's bytes_in when this entry was added, the running
+   * offset of its first byte among all bytes ever added
+   */
+  size_t offset;
+  /**
+   * Sequence number given by add_entry, one more than the entry added before
+   * it
+   */
+  uint64_t seq;
+  /**
+   * Commit time set by the caller before add_entry, in nanoseconds since the
+   * epoch
+   */
+  uint64_t timestamp_ns;
 };
 
 struct aesd_circular_buffer {
   /**
-   * An array of pointers to memory allocated for the most recent write
-   * operations
+   * The `capacity` slots holding the most recent write operations, this is
+   * inline_entry unless the ring was resized beyond it
    */
-  struct aesd_buffer_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+  struct aesd_buffer_entry *entry;
+  struct aesd_buffer_entry inline_entry[AESDCHAR_INLINE_ENTRIES];
   /**
-   * The current location in the entry structure where the next write should
-   * be stored.
+   * Number of slots in entry, always a power of two
    */
-  uint8_t in_offs;
+  uint32_t capacity;
   /**
-   * The first location in the entry structure to read from
+   * capacity - 1, in_offs and out_offs are masked with it to get a slot
    */
-  uint8_t out_offs;
+  uint32_t mask;
   /**
-   * set to true when the buffer entry structure is full
+   * Number of entries kept before the oldest one is replaced, at most
+   * capacity
+   */
+  uint32_t depth;
+  /**
+   * Free running count of entries added, the next write is stored in slot
+   * (in_offs & mask). in_offs - out_offs is the number of entries stored.
+   */
+  uint32_t in_offs;
+  /**
+   * Free running count of entries dropped, the oldest entry is in slot
+   * (out_offs & mask)
+   */
+  uint32_t out_offs;
+  /**
+   * set to true when depth entries are stored
    */
   bool full;
+  /**
+   * Free running count of bytes added, bytes_in - bytes_out is the number of
+   * bytes stored
+   */
+  size_t bytes_in;
+  /**
+   * Free running count of bytes dropped, the offset of the oldest entry
+   */
+  size_t bytes_out;
+  /**
+   * Sequence number of the next entry added, starts at 1 so that 0 never
+   * names an entry. Unlike in_offs it is kept across resizes.
+   */
+  uint64_t seq_in;
+  /**
+   * Number of entries dropped by add_entry or remove_oldest since init
+   */
+  uint64_t evicted;
 };
 
 extern struct aesd_buffer_entry *
@@ -61,16 +122,46 @@ aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern uint32_t
+aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern size_t
+aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer);
+
+extern size_t
+aesd_circular_buffer_entry_fpos(const struct aesd_circular_buffer *buffer,
+                                const struct aesd_buffer_entry *entry);
+
+extern struct aesd_buffer_entry *
+aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+                              uint32_t index);
+
+extern uint64_t
+aesd_circular_buffer_oldest_seq(const struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *
+aesd_circular_buffer_find_seq(struct aesd_circular_buffer *buffer,
+                              uint64_t seq);
+
+extern const char *
+aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *
+aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+                            struct aesd_buffer_entry *entries,
+                            uint32_t capacity, uint32_t depth);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to
  * free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an
+ * @param index is a uint32_t stack allocated value used by this macro for an
  * index
+ * Every slot of the storage is visited, used or not.
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -79,7 +170,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr, buffer, index)                  \
   for (index = 0, entryptr = &((buffer)->entry[index]);                        \
-       index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;                        \
+       index < (buffer)->capacity;                                             \
        index++, entryptr = &((buffer)->entry[index]))
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
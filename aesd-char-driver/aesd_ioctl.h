@@ -38,9 +38,216 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set the number of writes kept by the device, the oldest are dropped when
+// shrinking below the number stored
+#define AESDCHAR_IOCRESIZE _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Nonzero makes each read on this open file return at most one write, reads
+// otherwise continue across writes until the requested count is filled
+#define AESDCHAR_IOCRECMODE _IOW(AESD_IOC_MAGIC, 3, uint32_t)
+
+/**
+ * One record of a batch, stored as its own entry exactly as given, no
+ * newline is added or looked for
+ */
+struct aesd_record {
+    /**
+     * User space address of the record bytes
+     */
+    uint64_t buf;
+    uint32_t len;
+    /**
+     * Must be 0, the batch fails with EINVAL otherwise
+     */
+    uint32_t reserved;
+};
+
+/**
+ * A structure to be passed by IOCTL from user space to kernel space, listing
+ * records to commit as separate entries under one lock acquisition
+ */
+struct aesd_batch {
+    /**
+     * User space address of an array of count struct aesd_record
+     */
+    uint64_t records;
+    uint32_t count;
+    /**
+     * Set by the driver, the number of records committed from the start of
+     * the array. Fewer than count are accepted when a record fails or count
+     * is above AESDCHAR_BATCH_MAX, the caller resubmits the rest.
+     */
+    uint32_t accepted;
+    /**
+     * Set by the driver, the number of old entries dropped to make room
+     */
+    uint32_t evicted;
+    /**
+     * Must be 0, the batch fails with EINVAL otherwise
+     */
+    uint32_t reserved;
+};
+
+/**
+ * Upper bound for the records committed by one AESDCHAR_IOCBATCH
+ */
+#define AESDCHAR_BATCH_MAX 1024
+
+// Commit every record of a struct aesd_batch as its own entry
+#define AESDCHAR_IOCBATCH _IOWR(AESD_IOC_MAGIC, 4, struct aesd_batch)
+/**
+ * A structure to be passed by IOCTL from user space to kernel space, seeking
+ * to a write by its sequence number. Every committed write gets a sequence
+ * number one above the previous one, the first write after loading is number
+ * 1. Unlike write_cmd of struct aesd_seekto, a sequence number keeps naming
+ * the same write as older ones are dropped.
+ */
+struct aesd_seekseq {
+    /**
+     * The sequence number of the write to seek into. Set by the driver to the
+     * write the file now points into, the oldest one kept when the requested
+     * one was dropped, or one past the newest at the end of the data.
+     */
+    uint64_t seq;
+    /**
+     * Set by the driver, the number of writes from the requested one on that
+     * were dropped before they could be read
+     */
+    uint64_t lost;
+    /**
+     * The zero referenced offset within the write, ignored when it was dropped
+     */
+    uint32_t offset;
+    /**
+     * Must be 0, the seek fails with EINVAL otherwise
+     */
+    uint32_t reserved;
+};
+
+/**
+ * Filled by the driver, the range of sequence numbers still stored
+ */
+struct aesd_seqinfo {
+    /**
+     * Sequence number of the oldest write kept
+     */
+    uint64_t oldest;
+    /**
+     * Sequence number of the newest write, below oldest when none are kept
+     */
+    uint64_t newest;
+    /**
+     * Number of writes dropped since the device was loaded, by newer writes
+     * or by AESDCHAR_IOCRESIZE
+     */
+    uint64_t evicted;
+    /**
+     * Commit times of the oldest and newest write in nanoseconds since the
+     * epoch, 0 when none are kept
+     */
+    uint64_t oldest_ns;
+    uint64_t newest_ns;
+};
+
+/**
+ * Filled by the driver, the file position expressed as a write and an
+ * offset within it
+ */
+struct aesd_seqpos {
+    /**
+     * Sequence number of the write holding the file position, one past the
+     * newest at the end of the data
+     */
+    uint64_t seq;
+    /**
+     * Commit time of that write in nanoseconds since the epoch, 0 at the end
+     * of the data
+     */
+    uint64_t timestamp_ns;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t offset;
+    uint32_t reserved;
+};
+
+// Seek into the write with a given sequence number
+#define AESDCHAR_IOCSEEKSEQ _IOWR(AESD_IOC_MAGIC, 5, struct aesd_seekseq)
+// Get the sequence numbers of the oldest and newest write kept
+#define AESDCHAR_IOCSEQINFO _IOR(AESD_IOC_MAGIC, 6, struct aesd_seqinfo)
+// Get the sequence number of the write at the file position
+#define AESDCHAR_IOCTELLSEQ _IOR(AESD_IOC_MAGIC, 7, struct aesd_seqpos)
+
+/**
+ * Upper bound for the number of writes kept by the device
+ */
+#define AESDCHAR_MAX_RING_DEPTH 65536
+
+/**
+ * Layout of the read only mapping returned by mmap on the device, which is
+ * only available when the driver is loaded with mmap_data_size set. The header
+ * sits at offset 0, followed by the entry table at table_offset and the data
+ * area at data_offset. Byte position p of the stored writes, counted from the
+ * first write ever committed, is found at data_offset + (p & (data_size - 1))
+ * while bytes_out <= p < bytes_in.
+ *
+ * The driver makes seq odd while it updates the mapping. A reader loads seq,
+ * retries while it is odd, copies what it needs and loads seq again after a
+ * read barrier, the copy is consistent if both loads match.
+ */
+#define AESD_MMAP_MAGIC 0x41455344 // "AESD"
+/**
+ * Number of slots in the entry table, the most recent writes are described
+ */
+#define AESD_MMAP_ENTRY_SLOTS 1024
+
+struct aesd_mmap_header {
+    uint32_t magic;
+    /**
+     * Odd while the driver is updating the mapping
+     */
+    uint32_t seq;
+    /**
+     * Number of slots in the entry table, a power of two
+     */
+    uint32_t entry_slots;
+    uint32_t reserved;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    /**
+     * Size of the data area, a power of two
+     */
+    uint64_t data_size;
+    /**
+     * Producer position, bytes committed since the device was loaded
+     */
+    uint64_t bytes_in;
+    /**
+     * Position of the oldest byte still available in the data area
+     */
+    uint64_t bytes_out;
+    /**
+     * Writes committed, the last one is in slot
+     * (entries_in - 1) & (entry_slots - 1)
+     */
+    uint64_t entries_in;
+};
+
+struct aesd_mmap_entry {
+    /**
+     * Position of the first byte of the write, only usable while it is at
+     * least bytes_out
+     */
+    uint64_t offset;
+    uint32_t size;
+    /**
+     * CRC32C of the write when the driver checksums entries, 0 otherwise
+     */
+    uint32_t crc;
+};
+
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
 
 #endif /* AESD_IOCTL_H */
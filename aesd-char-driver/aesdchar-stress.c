@@ -0,0 +1,229 @@
+/**
+ * @file aesdchar-stress.c
+ * @brief Reader scaling of a loaded aesdchar driver, run with `make stress`
+ *
+ * Fills the device with records, then reads all of it over and over from a
+ * growing number of threads, optionally while another thread keeps writing,
+ * and prints the aggregate read rate for each thread count. The device is
+ * resized back to `-r depth` before exiting, by default the ring_depth it was
+ * loaded with. Writes still log through PDEBUG, build the driver without
+ * AESD_DEBUG before measuring with -w.
+ *
+ * usage: aesdchar-stress [-d device] [-t max_threads] [-s seconds] [-w]
+ *                        [-r depth]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+
+#define STRESS_RECORDS 4096
+#define STRESS_RECORD_LEN 64
+#define STRESS_READ_BUF (64 * 1024)
+#define STRESS_DEPTH_PARAM "/sys/module/aesdchar/parameters/ring_depth"
+
+static const char *device = "/dev/aesdchar";
+static atomic_bool stop;
+static atomic_ullong bytes_read;
+static atomic_ullong reads_done;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * write_record writes record number `n` as a single newline terminated write
+ */
+static int write_record(int fd, unsigned long n) {
+  char record[STRESS_RECORD_LEN];
+  memset(record, 'a' + n % 26, sizeof record);
+  snprintf(record, sizeof record, "%08lu ", n);
+  record[strlen(record)] = 'a' + n % 26;
+  record[sizeof record - 1] = '\n';
+  return write(fd, record, sizeof record) == sizeof record ? 0 : -1;
+}
+
+/**
+ * loaded_depth returns the ring_depth the driver was loaded with, or the
+ * default when the module parameter can't be read
+ */
+static uint32_t loaded_depth(void) {
+  unsigned int depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+  FILE *param = fopen(STRESS_DEPTH_PARAM, "r");
+  if (param != NULL) {
+    if (fscanf(param, "%u", &depth) != 1) {
+      depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    fclose(param);
+  }
+  return depth;
+}
+
+/**
+ * reader reads the whole device from the start until told to stop
+ */
+static void *reader(void *arg) {
+  (void)arg;
+  char *buf = malloc(STRESS_READ_BUF);
+  int fd = open(device, O_RDONLY | O_NONBLOCK);
+  if (buf == NULL || fd == -1) {
+    perror("reader");
+    free(buf);
+    return NULL;
+  }
+  unsigned long long bytes = 0;
+  unsigned long long reads = 0;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    off_t pos = 0;
+    ssize_t got;
+    while ((got = pread(fd, buf, STRESS_READ_BUF, pos)) > 0) {
+      pos += got;
+      bytes += got;
+      reads++;
+    }
+    if (got == -1 && errno != EAGAIN) {
+      perror("pread");
+      break;
+    }
+  }
+  atomic_fetch_add(&bytes_read, bytes);
+  atomic_fetch_add(&reads_done, reads);
+  close(fd);
+  free(buf);
+  return NULL;
+}
+
+/**
+ * writer keeps appending records until told to stop, so readers contend
+ * with a writer for the lock
+ */
+static void *writer(void *arg) {
+  int fd = *(int *)arg;
+  unsigned long n = STRESS_RECORDS;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    if (write_record(fd, n++) == -1) {
+      perror("write");
+      break;
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  double seconds = 2;
+  bool with_writer = false;
+  uint32_t restore_depth = loaded_depth();
+  int opt;
+  while ((opt = getopt(argc, argv, "d:t:s:wr:")) != -1) {
+    switch (opt) {
+    case 'd':
+      device = optarg;
+      break;
+    case 't':
+      max_threads = strtol(optarg, NULL, 10);
+      break;
+    case 's':
+      seconds = strtod(optarg, NULL);
+      break;
+    case 'w':
+      with_writer = true;
+      break;
+    case 'r':
+      restore_depth = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-d device] [-t max_threads] [-s seconds] [-w] "
+              "[-r depth]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  int fd = open(device, O_WRONLY);
+  if (fd == -1) {
+    perror(device);
+    return 1;
+  }
+  uint32_t depth = STRESS_RECORDS;
+  if (ioctl(fd, AESDCHAR_IOCRESIZE, &depth) == -1) {
+    perror("AESDCHAR_IOCRESIZE");
+    close(fd);
+    return 1;
+  }
+  int ret = 1;
+  pthread_t *threads = NULL;
+  for (unsigned long n = 0; n < STRESS_RECORDS; n++) {
+    if (write_record(fd, n) == -1) {
+      perror("write");
+      goto restore;
+    }
+  }
+
+  threads = calloc(max_threads, sizeof(pthread_t));
+  if (threads == NULL) {
+    goto restore;
+  }
+  double base = 0;
+  printf("%d records of %d bytes, %s\n", STRESS_RECORDS, STRESS_RECORD_LEN,
+         with_writer ? "one writer running" : "no writer");
+  // double the readers each step, ending with max_threads
+  for (long n = 1; n <= max_threads;
+       n = (n < max_threads && n * 2 > max_threads) ? max_threads : n * 2) {
+    pthread_t writer_thread;
+    atomic_store(&stop, false);
+    atomic_store(&bytes_read, 0);
+    atomic_store(&reads_done, 0);
+
+    double start = now_s();
+    for (long i = 0; i < n; i++) {
+      pthread_create(&threads[i], NULL, reader, NULL);
+    }
+    if (with_writer) {
+      pthread_create(&writer_thread, NULL, writer, &fd);
+    }
+    usleep(seconds * 1e6);
+    atomic_store(&stop, true);
+    for (long i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    if (with_writer) {
+      pthread_join(writer_thread, NULL);
+    }
+    double secs = now_s() - start;
+
+    double mbs = atomic_load(&bytes_read) / secs / (1024 * 1024);
+    if (n == 1) {
+      base = mbs;
+    }
+    printf("%3ld readers: %9.1f MB/s, %10.0f reads/s, %5.2fx\n", n, mbs,
+           atomic_load(&reads_done) / secs, base > 0 ? mbs / base : 0);
+  }
+  ret = 0;
+
+restore:
+  free(threads);
+  if (ioctl(fd, AESDCHAR_IOCRESIZE, &restore_depth) == -1) {
+    perror("AESDCHAR_IOCRESIZE restore");
+    ret = 1;
+  }
+  close(fd);
+  return ret;
+}
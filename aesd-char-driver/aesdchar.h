@@ -10,6 +10,8 @@
 
 #include "aesd-circular-buffer.h"
 #include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
 
 #define AESD_DEBUG 1 // Remove comment on this line to enable debug
 
@@ -34,8 +36,27 @@ struct aesd_dev {
   // in the case that the write/read functions do not send all the bytes
   // in one function call
   struct aesd_buffer_entry working_entry;
-  struct mutex dev_mutex;
+  // bytes allocated for working_entry.buffptr, at least its size
+  size_t working_cap;
+  // shared by readers, held exclusively by writes and resizes
+  struct rw_semaphore dev_rwsem;
+  // readers waiting at the end of the data, woken when a write is committed
+  wait_queue_head_t readq;
   struct cdev cdev; /* Char device structure      */
+  // read only view for mmap, see struct aesd_mmap_header, allocated with the
+  // device when mmap_data_size is set, NULL otherwise, and updated under
+  // dev_rwsem
+  void *mmap_area;
+};
+
+/**
+ * Per open state, kept in filp->private_data
+ */
+struct aesd_file {
+  struct aesd_dev *dev;
+  // when set a read stops at the end of the entry it started in, so each
+  // read returns at most one write, set with AESDCHAR_IOCRECMODE
+  bool record_reads;
 };
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
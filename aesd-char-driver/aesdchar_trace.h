@@ -0,0 +1,171 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints for the aesdchar driver
+ *
+ *  The events show up under /sys/kernel/tracing/events/aesdchar/ and can be
+ *  used with perf or bpftrace, e.g.
+ *    perf record -e 'aesdchar:*' -a
+ *    bpftrace -e 'tracepoint:aesdchar:aesd_write { @ = hist(args->count); }'
+ *  A disabled tracepoint is a static branch over the call, so leaving them in
+ *  the read/write paths costs nothing unless a tracer enables them.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * count is what the caller asked for, pos the file offset on entry and ret
+ * what the call returned (bytes or -errno)
+ */
+DECLARE_EVENT_CLASS(aesd_rw,
+	TP_PROTO(size_t count, loff_t pos, ssize_t ret),
+	TP_ARGS(count, pos, ret),
+	TP_STRUCT__entry(
+		__field(size_t, count)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+	),
+	TP_fast_assign(
+		__entry->count = count;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("count=%zu pos=%lld ret=%zd", __entry->count, __entry->pos,
+		  __entry->ret)
+);
+
+DEFINE_EVENT(aesd_rw, aesd_read,
+	TP_PROTO(size_t count, loff_t pos, ssize_t ret),
+	TP_ARGS(count, pos, ret)
+);
+
+/*
+ * committed is set when the write completed a newline terminated entry,
+ * entry_size is then the size of that entry
+ */
+TRACE_EVENT(aesd_write,
+	TP_PROTO(size_t count, loff_t pos, ssize_t ret, bool committed,
+		 size_t entry_size),
+	TP_ARGS(count, pos, ret, committed, entry_size),
+	TP_STRUCT__entry(
+		__field(size_t, count)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+		__field(bool, committed)
+		__field(size_t, entry_size)
+	),
+	TP_fast_assign(
+		__entry->count = count;
+		__entry->pos = pos;
+		__entry->ret = ret;
+		__entry->committed = committed;
+		__entry->entry_size = entry_size;
+	),
+	TP_printk("count=%zu pos=%lld ret=%zd committed=%d entry_size=%zu",
+		  __entry->count, __entry->pos, __entry->ret,
+		  __entry->committed, __entry->entry_size)
+);
+
+TRACE_EVENT(aesd_llseek,
+	TP_PROTO(loff_t off, int whence, loff_t newpos),
+	TP_ARGS(off, whence, newpos),
+	TP_STRUCT__entry(
+		__field(loff_t, off)
+		__field(int, whence)
+		__field(loff_t, newpos)
+	),
+	TP_fast_assign(
+		__entry->off = off;
+		__entry->whence = whence;
+		__entry->newpos = newpos;
+	),
+	TP_printk("off=%lld whence=%d newpos=%lld", __entry->off,
+		  __entry->whence, __entry->newpos)
+);
+
+TRACE_EVENT(aesd_ioctl,
+	TP_PROTO(unsigned int cmd, u32 write_cmd, u32 write_cmd_offset,
+		 loff_t pos, long ret),
+	TP_ARGS(cmd, write_cmd, write_cmd_offset, pos, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, cmd)
+		__field(u32, write_cmd)
+		__field(u32, write_cmd_offset)
+		__field(loff_t, pos)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->write_cmd = write_cmd;
+		__entry->write_cmd_offset = write_cmd_offset;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("cmd=0x%x write_cmd=%u write_cmd_offset=%u pos=%lld ret=%ld",
+		  __entry->cmd, __entry->write_cmd, __entry->write_cmd_offset,
+		  __entry->pos, __entry->ret)
+);
+
+/*
+ * count is the number of records submitted, accepted and evicted what the
+ * driver reported back
+ */
+TRACE_EVENT(aesd_batch,
+	TP_PROTO(u32 count, u32 accepted, u32 evicted, long ret),
+	TP_ARGS(count, accepted, evicted, ret),
+	TP_STRUCT__entry(
+		__field(u32, count)
+		__field(u32, accepted)
+		__field(u32, evicted)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->count = count;
+		__entry->accepted = accepted;
+		__entry->evicted = evicted;
+		__entry->ret = ret;
+	),
+	TP_printk("count=%u accepted=%u evicted=%u ret=%ld", __entry->count,
+		  __entry->accepted, __entry->evicted, __entry->ret)
+);
+
+/*
+ * seq is the write the file landed in and lost the number of writes skipped
+ * because they were dropped
+ */
+TRACE_EVENT(aesd_seekseq,
+	TP_PROTO(u64 seq, u64 lost, u32 offset, loff_t pos, long ret),
+	TP_ARGS(seq, lost, offset, pos, ret),
+	TP_STRUCT__entry(
+		__field(u64, seq)
+		__field(u64, lost)
+		__field(u32, offset)
+		__field(loff_t, pos)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->seq = seq;
+		__entry->lost = lost;
+		__entry->offset = offset;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("seq=%llu lost=%llu offset=%u pos=%lld ret=%ld",
+		  __entry->seq, __entry->lost, __entry->offset, __entry->pos,
+		  __entry->ret)
+);
+
+#endif /* AESDCHAR_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
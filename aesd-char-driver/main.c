@@ -15,280 +15,478 @@
 #include "aesd_ioctl.h"
 #include "aesdchar.h"
 #include <linux/cdev.h>
+#include <linux/crc32c.h>
 #include <linux/fs.h> // file_operations
 #include <linux/init.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/poll.h>
 #include <linux/printk.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
 #include <linux/types.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
 
 MODULE_AUTHOR("TheDavo"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+// checksum each entry when it is committed and check it before it is read,
+// read only so every entry in the buffer was written with the same setting
+static bool entry_crc;
+module_param(entry_crc, bool, 0444);
+MODULE_PARM_DESC(entry_crc, "Checksum buffer entries with CRC32C (default 0)");
+
+// number of writes kept in the buffer at load time, AESDCHAR_IOCRESIZE
+// changes it afterwards
+static uint ring_depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(ring_depth, uint, 0444);
+MODULE_PARM_DESC(ring_depth, "Number of writes kept in the buffer (default 10)");
+
+// size of the data area of the mapping, rounded up to a power of two. The
+// mapping is a second copy of every write, so it is only kept when asked for
+static uint mmap_data_size;
+module_param(mmap_data_size, uint, 0444);
+MODULE_PARM_DESC(mmap_data_size,
+                 "Bytes of data visible through mmap, each write is copied "
+                 "there as well (default 0, no mmap)");
+
+// number of /dev/aesdcharN instances, each with its own buffer and lock
+static uint aesd_nr_devs = 1;
+module_param_named(devices, aesd_nr_devs, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of independent aesdchar devices (default 1)");
+
+struct aesd_dev *aesd_devices;
+
+// size of the first piece a write copies, most lines fit in it, so little is
+// copied past the newline that ends a write
+#define AESD_WRITE_FIRST_PIECE 256
 int aesd_open(struct inode *inode, struct file *filp);
 int aesd_release(struct inode *inode, struct file *filp);
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                  loff_t *f_pos);
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                   loff_t *f_pos);
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence);
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t aesd_poll(struct file *filp, poll_table *wait);
 int aesd_adjust_file_offset(struct file *filp, uint32_t cmd,
                             uint32_t cmd_offset);
+int aesd_resize_ring(struct aesd_dev *dev, uint32_t depth);
+int aesd_append_batch(struct aesd_dev *dev, struct aesd_batch *batch);
+int aesd_seek_seq(struct file *filp, struct aesd_seekseq *seekseq);
+int aesd_seq_info(struct aesd_dev *dev, struct aesd_seqinfo *info);
+int aesd_tell_seq(struct file *filp, struct aesd_seqpos *pos);
 int aesd_init_module(void);
 void aesd_cleanup_module(void);
 
+/**
+ * aesd_entry_crc returns the CRC32C of the contents of @param entry
+ */
+static u32 aesd_entry_crc(const struct aesd_buffer_entry *entry) {
+  return ~crc32c(~0, entry->buffptr, entry->size);
+}
+
+/**
+ * aesd_mmap_copy appends @param entry to the data area and the entry table of
+ * the mapping of @param dev, if it has one
+ */
+static void aesd_mmap_copy(struct aesd_dev *dev,
+                           const struct aesd_buffer_entry *entry) {
+  struct aesd_mmap_header *hdr = dev->mmap_area;
+  char *data;
+  struct aesd_mmap_entry *table;
+  u64 mask;
+  u64 pos;
+  const char *src = entry->buffptr;
+  size_t len = entry->size;
+  size_t first;
+
+  if (NULL == hdr) {
+    return;
+  }
+  data = (char *)hdr + hdr->data_offset;
+  table = (struct aesd_mmap_entry *)((char *)hdr + hdr->table_offset);
+  mask = hdr->data_size - 1;
+  pos = hdr->bytes_in;
+
+  // only the tail of an entry larger than the data area can be kept
+  if (len > hdr->data_size) {
+    src += len - hdr->data_size;
+    pos += len - hdr->data_size;
+    len = hdr->data_size;
+  }
+  first = min_t(size_t, len, hdr->data_size - (pos & mask));
+  memcpy(data + (pos & mask), src, first);
+  memcpy(data, src + first, len - first);
+
+  table[hdr->entries_in & (hdr->entry_slots - 1)] = (struct aesd_mmap_entry){
+      .offset = hdr->bytes_in, .size = entry->size, .crc = entry->crc};
+  hdr->bytes_in += entry->size;
+  hdr->entries_in++;
+}
+
+/**
+ * aesd_mmap_begin makes readers of the mapping of @param dev retry until the
+ * matching aesd_mmap_end. The caller holds dev_rwsem for writing.
+ */
+static void aesd_mmap_begin(struct aesd_dev *dev) {
+  struct aesd_mmap_header *hdr = dev->mmap_area;
+
+  if (NULL == hdr) {
+    return;
+  }
+  WRITE_ONCE(hdr->seq, hdr->seq + 1);
+  smp_wmb();
+}
+
+/**
+ * aesd_mmap_end publishes the entries copied since aesd_mmap_begin and the
+ * start of the stored data to readers of the mapping of @param dev
+ */
+static void aesd_mmap_end(struct aesd_dev *dev) {
+  struct aesd_mmap_header *hdr = dev->mmap_area;
+  u64 stored;
+
+  if (NULL == hdr) {
+    return;
+  }
+  stored = min_t(u64, aesd_circular_buffer_size(&dev->buffer), hdr->data_size);
+  hdr->bytes_out = hdr->bytes_in - stored;
+  smp_wmb();
+  WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/**
+ * aesd_mmap_update publishes @param added, unless NULL, and the start of the
+ * stored data to readers of the mapping of @param dev. The caller holds
+ * dev_rwsem for writing.
+ */
+static void aesd_mmap_update(struct aesd_dev *dev,
+                             const struct aesd_buffer_entry *added) {
+  aesd_mmap_begin(dev);
+  if (NULL != added) {
+    aesd_mmap_copy(dev, added);
+  }
+  aesd_mmap_end(dev);
+}
+
+/**
+ * aesd_mmap_setup allocates the mapping of @param dev while it is set up,
+ * before it can be opened. The area never moves afterwards, so aesd_mmap,
+ * which runs under mmap_lock, does not need dev_rwsem: taking it there would
+ * invert the order of read_iter and write_iter, which fault on user memory
+ * while holding it. With mmap_data_size=0 there is no mapping and writes are
+ * not copied a second time.
+ */
+static int aesd_mmap_setup(struct aesd_dev *dev) {
+  size_t data_size =
+      roundup_pow_of_two(max_t(size_t, mmap_data_size, PAGE_SIZE));
+  size_t table_offset = PAGE_ALIGN(sizeof(struct aesd_mmap_header));
+  size_t data_offset = PAGE_ALIGN(
+      table_offset + AESD_MMAP_ENTRY_SLOTS * sizeof(struct aesd_mmap_entry));
+  struct aesd_mmap_header *hdr;
+
+  if (0 == mmap_data_size) {
+    return 0;
+  }
+  // vmalloc_user memory is zeroed and may be mapped to user space
+  hdr = vmalloc_user(data_offset + data_size);
+  if (NULL == hdr) {
+    return -ENOMEM;
+  }
+  hdr->magic = AESD_MMAP_MAGIC;
+  hdr->entry_slots = AESD_MMAP_ENTRY_SLOTS;
+  hdr->table_offset = table_offset;
+  hdr->data_offset = data_offset;
+  hdr->data_size = data_size;
+  dev->mmap_area = hdr;
+  return 0;
+}
+
 int aesd_open(struct inode *inode, struct file *filp) {
   PDEBUG("opening aesd device driver");
 
-  struct aesd_dev *dev;
-  dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-  filp->private_data = dev;
+  struct aesd_file *file;
+  file = kzalloc(sizeof(*file), GFP_KERNEL);
+  if (NULL == file) {
+    return -ENOMEM;
+  }
+  file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+  filp->private_data = file;
+  // read, write and lseek on a descriptor shared between threads take
+  // f_pos_lock, as for regular files, so their position updates do not get
+  // lost. dev_rwsem cannot do this: the VFS copies ki_pos back to f_pos
+  // after read_iter and write_iter return. The seek ioctls do not take
+  // f_pos_lock and still race with I/O on the same descriptor.
+  filp->f_mode |= FMODE_ATOMIC_POS;
   return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp) {
   PDEBUG("release");
-  // since everything in filp->private_data was allocated in the module
-  // init function, aesd_release does not have to deallocate anything here
-  //
-  // if content was allocated in the `open` function, then memory would have
-  // to be freed here instead of the module exit function
+  // the device itself was allocated in the module init function, only the
+  // per open state from aesd_open is freed here
+  kfree(filp->private_data);
   return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                  loff_t *f_pos) {
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to) {
   ssize_t retval = 0;
-  PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+  struct file *filp = iocb->ki_filp;
+  size_t count = iov_iter_count(to);
+  loff_t *f_pos = &iocb->ki_pos;
 
-  struct aesd_dev *dev = filp->private_data;
+  struct aesd_file *file = filp->private_data;
+  struct aesd_dev *dev = file->dev;
 
-  if (mutex_lock_interruptible(&dev->dev_mutex)) {
-    PDEBUG("aesd_read: failed to lock mutex");
+  // readers only share the lock, any number of them can copy out at once
+  if (down_read_interruptible(&dev->dev_rwsem)) {
+    PDEBUG("aesd_read: failed to lock rwsem");
     return -ERESTARTSYS;
   }
 
-  // have the mutex, can now safely send content back to the user
-
-  // continue to send content to the user until the amount sent is the
-  // amount requested, or an error occurs
-  // get the relevant entry based on *f_pos
-  size_t offset_in_entry;
-  struct aesd_buffer_entry *entry =
-      aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos,
-                                                      &offset_in_entry);
-
-  if (NULL == entry) {
-    PDEBUG("aesd_read: entry at f_pos returned NULL, buffer may be empty or at "
-           "EOF");
-    PDEBUG("aesd_read: retval at NULL == entry %lu", retval);
-    ssize_t sum = 0;
-    size_t i;
-    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-      // PDEBUG("i: %lu str: %s size: %lu", i,
-      // aesd_device.buffer.entry[i].buffptr, aesd_device.buffer.entry[i].size);
-      sum += aesd_device.buffer.entry[i].size;
-    }
-    PDEBUG("size of buffer at NULL == entry %ld", sum);
-    mutex_unlock(&dev->dev_mutex);
-    return retval;
+  // at the end of the data a blocking read sleeps until the next write is
+  // committed, positions are relative to the oldest write kept so the
+  // running byte count tells whether anything was added
+  while (count > 0 && *f_pos >= aesd_circular_buffer_size(&dev->buffer)) {
+    size_t bytes_in = dev->buffer.bytes_in;
+    up_read(&dev->dev_rwsem);
+    if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+      trace_aesd_read(count, *f_pos, -EAGAIN);
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(dev->readq,
+                                 READ_ONCE(dev->buffer.bytes_in) != bytes_in)) {
+      return -ERESTARTSYS;
+    }
+    if (down_read_interruptible(&dev->dev_rwsem)) {
+      return -ERESTARTSYS;
+    }
   }
 
-  // have a valid entry, can now start sending content to user
+  // have the lock, can now safely send content back to the user
 
-  // send out partial content, from the offset to the end of the current
-  // entry
-  size_t count_bytes_to_send;
-  if (count > entry->size - offset_in_entry) {
-    count_bytes_to_send = entry->size - offset_in_entry;
-  } else {
-    count_bytes_to_send = count;
-  }
+  // continue to send content to the user until the amount sent is the
+  // amount requested, the data ends or an error occurs. Each pass sends the
+  // part of one entry found at the current position, in record mode only a
+  // single pass is made.
+  while ((size_t)retval < count) {
+    size_t offset_in_entry;
+    struct aesd_buffer_entry *entry =
+        aesd_circular_buffer_find_entry_offset_for_fpos(
+            &dev->buffer, *f_pos + retval, &offset_in_entry);
+
+    if (NULL == entry) {
+      // empty buffer or end of data
+      break;
+    }
 
-  // since partial content is being sent, the copy_to_user call must account
-  // for that by adding the amount of bytes already sent to the initial
-  // user buffer location
+    // an entry is checked once per pass, when a read starts at its beginning
+    if (entry_crc && 0 == offset_in_entry &&
+        aesd_entry_crc(entry) != entry->crc) {
+      pr_err("aesdchar: entry at offset %lld failed its crc check\n",
+             *f_pos + retval);
+      // hand out what was copied so far, the next read reports the error
+      if (0 == retval) {
+        retval = -EIO;
+      }
+      break;
+    }
 
-  // copy_to_user sends a 0 on success, so anything else is an error
-  if (copy_to_user(buf, entry->buffptr + offset_in_entry,
-                   count_bytes_to_send)) {
-    PDEBUG("aesd_read: error sending content to user");
-    retval = -EFAULT;
-    mutex_unlock(&dev->dev_mutex);
-    return retval;
-  }
+    // send out partial content, from the offset to the end of the current
+    // entry
+    size_t count_bytes_to_send = entry->size - offset_in_entry;
+    if (count_bytes_to_send > count - retval) {
+      count_bytes_to_send = count - retval;
+    }
 
-  // successfully copied to user, update file position and amount of bytes
-  // read
-  // *f_pos += count_bytes_to_send;
-  retval = count_bytes_to_send;
-  PDEBUG("aesd_read: count %lu", count);
-  PDEBUG("aesd_read: count_bytes_to_send %lu", count_bytes_to_send);
-  PDEBUG("aesd_read: retval %lu", retval);
+    // copy_to_iter returns the bytes copied, a short copy means a fault in
+    // the destination
+    size_t copied = copy_to_iter(entry->buffptr + offset_in_entry,
+                                 count_bytes_to_send, to);
+    retval += copied;
+    if (copied != count_bytes_to_send) {
+      PDEBUG("aesd_read: error sending content to user");
+      if (0 == retval) {
+        retval = -EFAULT;
+      }
+      break;
+    }
 
-  ssize_t sum = 0;
-  size_t i;
-  for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-    sum += aesd_device.buffer.entry[i].size;
+    if (file->record_reads) {
+      break;
+    }
   }
 
-  // no more bytes to read, end of file
-  if (*f_pos > sum) {
-    retval = 0;
+  trace_aesd_read(count, *f_pos, retval);
+  if (retval > 0) {
+    *f_pos += retval;
   }
-
-  *f_pos += retval;
-  mutex_unlock(&dev->dev_mutex);
+  up_read(&dev->dev_rwsem);
   return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                   loff_t *f_pos) {
-  // in this function a new entry will be created to be added to the
-  // circular buffer
-  ssize_t retval = -ENOMEM;
-  PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-  struct aesd_dev *dev = filp->private_data;
-
-  if (mutex_lock_interruptible(&dev->dev_mutex)) {
-    PDEBUG("aesd_read: failed to lock mutex");
-    return -ERESTARTSYS;
+/**
+ * aesd_working_reserve makes room for @param needed bytes in the entry being
+ * assembled in @param dev, keeping the first @param used bytes. A partial
+ * entry grows to at least twice its capacity in whole pages, so a long line
+ * written in pieces is not copied again on every write.
+ */
+static int aesd_working_reserve(struct aesd_dev *dev, size_t used,
+                                size_t needed) {
+  struct aesd_buffer_entry *working = &dev->working_entry;
+  size_t capacity = needed;
+  char *grown;
+
+  if (needed <= dev->working_cap) {
+    return 0;
   }
-
-  char *kbuff = kzalloc(count, GFP_KERNEL);
-  if (NULL == kbuff) {
-    PDEBUG("aesd_write: error allocating buffer for __user *buf");
-    retval = -EFAULT;
-    mutex_unlock(&dev->dev_mutex);
-    return retval;
+  // the first piece of an entry is allocated to size, most writes are a
+  // whole line
+  if (0 != used) {
+    capacity = PAGE_ALIGN(max_t(size_t, needed, 2 * dev->working_cap));
   }
 
-  // pointers/memory allocated, can copy from the user now
-  PDEBUG("copy_from_user count %lu", count);
-  if (copy_from_user(kbuff, buf, count)) {
-    PDEBUG("aesd_write: error copying from user to kernel allocated buffer");
-    retval = -EFAULT;
-    mutex_unlock(&dev->dev_mutex);
-    return retval;
+  grown = kmalloc(capacity, GFP_KERNEL);
+  if (NULL == grown) {
+    return -ENOMEM;
   }
-
-  // a new buffer entry shall not be placed in to the buffer until a newline
-  // character is found, work with dev->working_entry for that case
-
-  size_t offset = 0;
-
-  // assume that all the count bytes will be added to the working buffer entry
-  size_t bytes_to_add = count;
-
-  // check if kbuff has a newline, that will determine how much to add to
-  // an existing buffer
-  // from aesdsocket implementation to find newline character
-  char *newline_pos_kbuff = (char *)memchr(kbuff, '\n', count);
-  if (NULL != newline_pos_kbuff) {
-    bytes_to_add = newline_pos_kbuff - kbuff + 1; // include the newline
-    PDEBUG("aesd_write: newline found in kbuff, bytes_to_add is %lu",
-           bytes_to_add);
+  if (NULL != working->buffptr) {
+    memcpy(grown, working->buffptr, used);
+    kfree(working->buffptr);
   }
+  working->buffptr = grown;
+  dev->working_cap = capacity;
+  return 0;
+}
 
-  // if the working entry already has content in memory krealloac has to be
-  // used to ask for more memory from the kernel
-  if (NULL != dev->working_entry.buffptr) {
-    dev->working_entry.buffptr =
-        krealloc(dev->working_entry.buffptr,
-                 dev->working_entry.size + bytes_to_add, GFP_KERNEL);
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  // in this function the bytes are appended to dev->working_entry, which is
+  // added to the circular buffer once a newline completes it
+  ssize_t retval;
+  struct file *filp = iocb->ki_filp;
+  size_t count = iov_iter_count(from);
+  loff_t *f_pos = &iocb->ki_pos;
+  size_t chunk = AESD_WRITE_FIRST_PIECE;
+  PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+  struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+  struct aesd_buffer_entry *working = &dev->working_entry;
+  const char *newline = NULL;
+  size_t committed_size = 0;
+  size_t done = 0;
+
+  if (down_write_killable(&dev->dev_rwsem)) {
+    PDEBUG("aesd_write: failed to lock rwsem");
+    return -ERESTARTSYS;
+  }
 
-    if (NULL == dev->working_entry.buffptr) {
-      PDEBUG("aesd_write: krealloc error");
-      retval = -EFAULT;
-      mutex_unlock(&dev->dev_mutex);
-      return retval;
+  // copy from the user straight into the working entry in pieces that
+  // double up to a page, stopping at the piece that holds a newline. The
+  // write returns after the newline and the iterator is moved back over the
+  // rest of that piece, the caller writes it again.
+  while (done < count && NULL == newline) {
+    size_t piece = min_t(size_t, count - done, chunk);
+    size_t at = working->size + done;
+    char *dest;
+
+    retval = aesd_working_reserve(dev, at, at + piece);
+    if (retval) {
+      PDEBUG("aesd_write: error growing the working entry");
+      goto out;
     }
-
-    offset = dev->working_entry.size;
-    dev->working_entry.size = dev->working_entry.size + bytes_to_add;
-  } else {
-    // allocate a new buffer pointer
-    dev->working_entry.buffptr = kzalloc(bytes_to_add, GFP_KERNEL);
-    dev->working_entry.size = bytes_to_add;
-
-    if (NULL == dev->working_entry.buffptr) {
-      PDEBUG("aesd_write: kzalloc error");
+    dest = (char *)working->buffptr + at;
+    if (copy_from_iter(dest, piece, from) != piece) {
+      PDEBUG("aesd_write: error copying from user to the working entry");
       retval = -EFAULT;
-      mutex_unlock(&dev->dev_mutex);
-      return retval;
+      goto out;
     }
+    newline = memchr(dest, '\n', piece);
+    if (NULL != newline) {
+      iov_iter_revert(from, piece - (newline - dest + 1));
+      piece = newline - dest + 1;
+    }
+    done += piece;
+    chunk = min_t(size_t, 2 * chunk, PAGE_SIZE);
   }
+  working->size += done;
 
-  if (NULL == dev->working_entry.buffptr) {
-    PDEBUG("aesd_write: working_entry.buffptr NULL before memcpy");
-    kfree(kbuff);
-    mutex_unlock(&dev->dev_mutex);
-    return -EFAULT;
-  }
-
-  memcpy((void *)(dev->working_entry.buffptr + offset), kbuff, bytes_to_add);
-
-  if (NULL != newline_pos_kbuff) {
+  if (NULL != newline) {
     PDEBUG("aesd_write: new entry added to dev->buffer");
-    const char *released =
-        aesd_circular_buffer_add_entry(&dev->buffer, &dev->working_entry);
+    committed_size = working->size;
+    if (entry_crc) {
+      working->crc = aesd_entry_crc(working);
+    }
+    working->timestamp_ns = ktime_get_real_ns();
+    const char *released = aesd_circular_buffer_add_entry(&dev->buffer, working);
     if (NULL != released) {
       kfree(released);
     }
-
-    // reset working_entry for the next write
-    dev->working_entry.buffptr = NULL;
-    dev->working_entry.size = 0;
+    aesd_mmap_update(dev, aesd_circular_buffer_entry_at(
+                              &dev->buffer,
+                              aesd_circular_buffer_count(&dev->buffer) - 1));
+
+    // reset working_entry for the next write, the buffer now belongs to the
+    // circular buffer
+    working->buffptr = NULL;
+    working->size = 0;
+    working->crc = 0;
+    working->timestamp_ns = 0;
+    dev->working_cap = 0;
   }
+  retval = done;
 
-  kfree(kbuff);
-
-   mutex_unlock(&dev->dev_mutex);
-  retval = bytes_to_add;
+out:
+  up_write(&dev->dev_rwsem);
+  // newline is only left set once the entry was committed
+  if (NULL != newline) {
+    wake_up_interruptible(&dev->readq);
+  }
+  trace_aesd_write(count, *f_pos, retval, NULL != newline, committed_size);
   // add the bytes written to the offset so that the llseek function will
   // work
-  *f_pos += retval;
+  if (retval > 0) {
+    *f_pos += retval;
+  }
   return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
-  struct aesd_dev *aesd_device = filp->private_data;
+  struct aesd_dev *aesd_device =
+      ((struct aesd_file *)filp->private_data)->dev;
   loff_t newpos;
   loff_t sum = 0;
-  size_t i;
 
   switch (whence) {
   case SEEK_SET:
     newpos = off;
     break;
   case SEEK_CUR:
-    // seek from the current file offset
-    // lock the mutex here so that the file offset cannot be changed
-    // from the read/write functions
-    if (mutex_lock_interruptible(&aesd_device->dev_mutex)) {
-      PDEBUG("aesd_llseek: mutex lock failed");
-      return -ERESTARTSYS;
-    }
+    // seek from the current file offset, f_pos is not ring state and
+    // dev_rwsem does not guard it, see aesd_open
     newpos = filp->f_pos + off;
-    mutex_unlock(&aesd_device->dev_mutex);
     break;
   case SEEK_END:
     // seek from the end of the file
     // the "file size" is the amount of buffers that have content in them
 
-    // lock the mutex here so that while the sum is being calculated other
-    // threads cannot add content to the buffer
-    if (mutex_lock_interruptible(&aesd_device->dev_mutex)) {
-      PDEBUG("aesd_llseek: mutex lock failed");
+    // lock here so that while the size is being read other threads cannot
+    // add content to the buffer
+    if (down_read_interruptible(&aesd_device->dev_rwsem)) {
+      PDEBUG("aesd_llseek: rwsem lock failed");
       return -ERESTARTSYS;
     }
-    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-      sum += aesd_device->buffer.entry[i].size;
-    }
-    mutex_unlock(&aesd_device->dev_mutex);
+    sum = aesd_circular_buffer_size(&aesd_device->buffer);
+    up_read(&aesd_device->dev_rwsem);
     newpos = sum + off;
     break;
   default:
@@ -300,58 +498,321 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
   }
 
   filp->f_pos = newpos;
+  trace_aesd_llseek(off, whence, newpos);
   return newpos;
 }
 
 int aesd_adjust_file_offset(struct file *filp, uint32_t cmd,
                             uint32_t cmd_offset) {
   int retval = 0;
-  struct aesd_dev *aesd_device = filp->private_data;
-
-  // check cmd is within valid range
-  if (cmd < 0 || cmd > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-    retval = -EINVAL;
-    return retval;
-  }
+  struct aesd_dev *aesd_device =
+      ((struct aesd_file *)filp->private_data)->dev;
+  struct aesd_buffer_entry *entry;
 
-  if (mutex_lock_interruptible(&aesd_device->dev_mutex)) {
+  // the ring is only read, f_pos is set like lseek sets it, see aesd_open
+  // for how it is ordered against I/O
+  if (down_read_interruptible(&aesd_device->dev_rwsem)) {
     retval = -ERESTARTSYS;
     return retval;
   }
 
-  // check if the entry exists
-  if (aesd_device->buffer.entry[cmd].buffptr == NULL) {
+  // check if the entry exists, cmd counts from the oldest write kept
+  entry = aesd_circular_buffer_entry_at(&aesd_device->buffer, cmd);
+  if (NULL == entry) {
     retval = -EINVAL;
+    up_read(&aesd_device->dev_rwsem);
     return retval;
   }
 
   // bounds check cmd offset
-  if (cmd_offset > aesd_device->buffer.entry[cmd].size) {
+  if (cmd_offset > entry->size) {
     retval = -EINVAL;
+    up_read(&aesd_device->dev_rwsem);
     return retval;
   }
 
   PDEBUG("aesd_adjust_file_offset: adjusting for command %u at offset %u", cmd,
          cmd_offset);
   // calculate the offset from zero
-  loff_t offset = 0;
-  // go up to the cmd (not including it) and add the sizes up
-  for (int i = 0; i < cmd; i++) {
-    offset += aesd_device->buffer.entry[i].size;
-  }
-
+  loff_t offset = aesd_circular_buffer_entry_fpos(&aesd_device->buffer, entry);
   offset += cmd_offset;
   PDEBUG("aesd_adjust_file_offset: final offset %llu", offset);
   filp->f_pos = offset;
-  mutex_unlock(&aesd_device->dev_mutex);
+  up_read(&aesd_device->dev_rwsem);
+
+  return retval;
+}
+
+/**
+ * aesd_resize_ring keeps up to @param depth writes in @param dev from now on,
+ * dropping the oldest ones if more are stored. Storage is allocated at the
+ * next power of two, the buffer's inline slots are used while they suffice.
+ */
+int aesd_resize_ring(struct aesd_dev *dev, uint32_t depth) {
+  struct aesd_buffer_entry *entries = NULL;
+  struct aesd_buffer_entry *previous;
+  uint32_t capacity = 0;
+
+  if (depth < 1 || depth > AESDCHAR_MAX_RING_DEPTH) {
+    return -EINVAL;
+  }
+
+  // allocate before taking the lock, the ring can be large
+  if (depth > AESDCHAR_INLINE_ENTRIES) {
+    capacity = roundup_pow_of_two(depth);
+    entries = kvcalloc(capacity, sizeof(*entries), GFP_KERNEL);
+    if (NULL == entries) {
+      return -ENOMEM;
+    }
+  }
+
+  if (down_write_killable(&dev->dev_rwsem)) {
+    kvfree(entries);
+    return -ERESTARTSYS;
+  }
+
+  while (aesd_circular_buffer_count(&dev->buffer) > depth) {
+    kfree(aesd_circular_buffer_remove_oldest(&dev->buffer));
+  }
+  previous =
+      aesd_circular_buffer_resize(&dev->buffer, entries, capacity, depth);
+  aesd_mmap_update(dev, NULL);
+
+  up_write(&dev->dev_rwsem);
+
+  kvfree(previous);
+  PDEBUG("aesd_resize_ring: depth %u", depth);
+  return 0;
+}
+
+/**
+ * aesd_append_batch commits the records listed in @param batch to @param dev,
+ * each as its own entry, and fills in the accepted and evicted counts. The
+ * records are copied in before taking the lock, so readers are not held up
+ * by page faults in the producer's memory. Records copied before a failing
+ * one are still committed. A nonzero reserved field in the batch or any of
+ * its records fails the whole call with -EINVAL before anything is copied.
+ */
+int aesd_append_batch(struct aesd_dev *dev, struct aesd_batch *batch) {
+  uint32_t count = min_t(uint32_t, batch->count, AESDCHAR_BATCH_MAX);
+  struct aesd_record *records = NULL;
+  struct aesd_buffer_entry *entries = NULL;
+  uint32_t filled;
+  uint32_t i;
+  u64 now;
+  int retval = 0;
+
+  batch->accepted = 0;
+  batch->evicted = 0;
+  if (0 != batch->reserved) {
+    return -EINVAL;
+  }
+  if (0 == count) {
+    return 0;
+  }
+
+  records = kvmalloc_array(count, sizeof(*records), GFP_KERNEL);
+  entries = kvmalloc_array(count, sizeof(*entries), GFP_KERNEL);
+  if (NULL == records || NULL == entries) {
+    retval = -ENOMEM;
+    goto out;
+  }
+  if (copy_from_user(records, u64_to_user_ptr(batch->records),
+                     count * sizeof(*records))) {
+    retval = -EFAULT;
+    goto out;
+  }
+  for (i = 0; i < count; i++) {
+    if (0 != records[i].reserved) {
+      retval = -EINVAL;
+      goto out;
+    }
+  }
+
+  for (filled = 0; filled < count; filled++) {
+    struct aesd_buffer_entry *entry = &entries[filled];
+    char *data;
+
+    if (0 == records[filled].len) {
+      retval = -EINVAL;
+      break;
+    }
+    data = kmalloc(records[filled].len, GFP_KERNEL);
+    if (NULL == data) {
+      retval = -ENOMEM;
+      break;
+    }
+    if (copy_from_user(data, u64_to_user_ptr(records[filled].buf),
+                       records[filled].len)) {
+      kfree(data);
+      retval = -EFAULT;
+      break;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->buffptr = data;
+    entry->size = records[filled].len;
+    if (entry_crc) {
+      entry->crc = aesd_entry_crc(entry);
+    }
+  }
+  if (0 == filled) {
+    goto out;
+  }
+
+  if (down_write_killable(&dev->dev_rwsem)) {
+    for (i = 0; i < filled; i++) {
+      kfree(entries[i].buffptr);
+    }
+    retval = -ERESTARTSYS;
+    goto out;
+  }
+  // the whole batch is committed at once, and published to the mapping once
+  // at the end. Each record is copied as it is added, a large batch may
+  // evict its own first records from the ring.
+  now = ktime_get_real_ns();
+  aesd_mmap_begin(dev);
+  for (i = 0; i < filled; i++) {
+    entries[i].timestamp_ns = now;
+    aesd_mmap_copy(dev, &entries[i]);
+    const char *released =
+        aesd_circular_buffer_add_entry(&dev->buffer, &entries[i]);
+    if (NULL != released) {
+      kfree(released);
+      batch->evicted++;
+    }
+  }
+  aesd_mmap_end(dev);
+  up_write(&dev->dev_rwsem);
+  wake_up_interruptible(&dev->readq);
+
+  // what was committed is reported, the failure shows on the resubmission
+  batch->accepted = filled;
+  retval = 0;
+
+out:
+  kvfree(records);
+  kvfree(entries);
+  return retval;
+}
+
+/**
+ * aesd_seek_seq points @param filp into the write numbered seekseq->seq, or
+ * into the oldest write kept when that one was dropped, and reports back the
+ * write it landed in and how many were lost on the way. A nonzero reserved
+ * field is rejected with -EINVAL.
+ */
+int aesd_seek_seq(struct file *filp, struct aesd_seekseq *seekseq) {
+  struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+  struct aesd_buffer_entry *entry;
+  uint64_t oldest;
+  uint32_t offset = seekseq->offset;
+  int retval = 0;
+
+  if (0 != seekseq->reserved) {
+    return -EINVAL;
+  }
+  // the ring is only read, see aesd_adjust_file_offset
+  if (down_read_interruptible(&dev->dev_rwsem)) {
+    return -ERESTARTSYS;
+  }
 
+  // one past the newest write is the end of the data, anything beyond was
+  // never written
+  seekseq->lost = 0;
+  if (0 == seekseq->seq || seekseq->seq > dev->buffer.seq_in) {
+    retval = -EINVAL;
+    goto out;
+  }
+  oldest = aesd_circular_buffer_oldest_seq(&dev->buffer);
+  if (seekseq->seq < oldest) {
+    seekseq->lost = oldest - seekseq->seq;
+    seekseq->seq = oldest;
+    offset = 0;
+  }
+
+  entry = aesd_circular_buffer_find_seq(&dev->buffer, seekseq->seq);
+  if (NULL == entry) {
+    if (0 != offset) {
+      retval = -EINVAL;
+      goto out;
+    }
+    filp->f_pos = aesd_circular_buffer_size(&dev->buffer);
+  } else {
+    if (offset > entry->size) {
+      retval = -EINVAL;
+      goto out;
+    }
+    filp->f_pos = aesd_circular_buffer_entry_fpos(&dev->buffer, entry) + offset;
+  }
+
+out:
+  up_read(&dev->dev_rwsem);
+  trace_aesd_seekseq(seekseq->seq, seekseq->lost, offset, filp->f_pos, retval);
   return retval;
 }
 
+/**
+ * aesd_seq_info fills @param info with the sequence numbers and commit times
+ * of the writes stored in @param dev
+ */
+int aesd_seq_info(struct aesd_dev *dev, struct aesd_seqinfo *info) {
+  uint32_t count;
+
+  memset(info, 0, sizeof(*info));
+  if (down_read_interruptible(&dev->dev_rwsem)) {
+    return -ERESTARTSYS;
+  }
+  count = aesd_circular_buffer_count(&dev->buffer);
+  info->oldest = aesd_circular_buffer_oldest_seq(&dev->buffer);
+  info->newest = dev->buffer.seq_in - 1;
+  info->evicted = dev->buffer.evicted;
+  if (count > 0) {
+    info->oldest_ns =
+        aesd_circular_buffer_entry_at(&dev->buffer, 0)->timestamp_ns;
+    info->newest_ns =
+        aesd_circular_buffer_entry_at(&dev->buffer, count - 1)->timestamp_ns;
+  }
+  up_read(&dev->dev_rwsem);
+  return 0;
+}
+
+/**
+ * aesd_tell_seq fills @param pos with the write holding the file position of
+ * @param filp
+ */
+int aesd_tell_seq(struct file *filp, struct aesd_seqpos *pos) {
+  struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+  struct aesd_buffer_entry *entry;
+  size_t entry_offset = 0;
+
+  memset(pos, 0, sizeof(*pos));
+  if (down_read_interruptible(&dev->dev_rwsem)) {
+    return -ERESTARTSYS;
+  }
+  entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+      &dev->buffer, filp->f_pos, &entry_offset);
+  if (NULL == entry) {
+    pos->seq = dev->buffer.seq_in;
+  } else {
+    pos->seq = entry->seq;
+    pos->timestamp_ns = entry->timestamp_ns;
+    pos->offset = entry_offset;
+  }
+  up_read(&dev->dev_rwsem);
+  return 0;
+}
+
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 
   long retval = 0;
+  struct aesd_file *file = filp->private_data;
   struct aesd_seekto seekto;
+  uint32_t depth;
+  uint32_t record_reads;
+  struct aesd_batch batch;
+  struct aesd_seekseq seekseq;
+  struct aesd_seqinfo info;
+  struct aesd_seqpos pos;
   switch (cmd) {
   case AESDCHAR_IOCSEEKTO:
     // unsigned long arg is the pointer that would be used
@@ -361,6 +822,54 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     } else {
       retval = aesd_adjust_file_offset(filp, seekto.write_cmd,
                                        seekto.write_cmd_offset);
+      trace_aesd_ioctl(cmd, seekto.write_cmd, seekto.write_cmd_offset,
+                       filp->f_pos, retval);
+    }
+    break;
+  case AESDCHAR_IOCRESIZE:
+    if (copy_from_user(&depth, (const void __user *)arg, sizeof(depth))) {
+      return -EFAULT;
+    }
+    retval = aesd_resize_ring(file->dev, depth);
+    break;
+  case AESDCHAR_IOCRECMODE:
+    if (copy_from_user(&record_reads, (const void __user *)arg,
+                       sizeof(record_reads))) {
+      return -EFAULT;
+    }
+    file->record_reads = record_reads != 0;
+    break;
+  case AESDCHAR_IOCBATCH:
+    if (copy_from_user(&batch, (const void __user *)arg, sizeof(batch))) {
+      return -EFAULT;
+    }
+    retval = aesd_append_batch(file->dev, &batch);
+    if (0 == retval &&
+        copy_to_user((void __user *)arg, &batch, sizeof(batch))) {
+      retval = -EFAULT;
+    }
+    trace_aesd_batch(batch.count, batch.accepted, batch.evicted, retval);
+    break;
+  case AESDCHAR_IOCSEEKSEQ:
+    if (copy_from_user(&seekseq, (const void __user *)arg, sizeof(seekseq))) {
+      return -EFAULT;
+    }
+    retval = aesd_seek_seq(filp, &seekseq);
+    if (0 == retval &&
+        copy_to_user((void __user *)arg, &seekseq, sizeof(seekseq))) {
+      retval = -EFAULT;
+    }
+    break;
+  case AESDCHAR_IOCSEQINFO:
+    retval = aesd_seq_info(file->dev, &info);
+    if (0 == retval && copy_to_user((void __user *)arg, &info, sizeof(info))) {
+      retval = -EFAULT;
+    }
+    break;
+  case AESDCHAR_IOCTELLSEQ:
+    retval = aesd_tell_seq(filp, &pos);
+    if (0 == retval && copy_to_user((void __user *)arg, &pos, sizeof(pos))) {
+      retval = -EFAULT;
     }
     break;
   default:
@@ -369,77 +878,183 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
   return retval;
 }
 
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma) {
+  struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+  int retval;
+
+  if (NULL == dev->mmap_area) {
+    return -ENODEV;
+  }
+  // only the driver writes to the mapping
+  if (vma->vm_flags & VM_WRITE) {
+    return -EPERM;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_clear(vma, VM_MAYWRITE);
+#else
+  vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+  // fails for mappings larger than the area, see aesd_mmap_setup for why
+  // there is no dev_rwsem here
+  retval = remap_vmalloc_range(vma, dev->mmap_area, vma->vm_pgoff);
+
+  PDEBUG("aesd_mmap: %lu bytes at page %lu returned %d",
+         vma->vm_end - vma->vm_start, vma->vm_pgoff, retval);
+  return retval;
+}
+
+__poll_t aesd_poll(struct file *filp, poll_table *wait) {
+  struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+  // writes never block
+  __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+  poll_wait(filp, &dev->readq, wait);
+
+  down_read(&dev->dev_rwsem);
+  if (filp->f_pos < aesd_circular_buffer_size(&dev->buffer)) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  up_read(&dev->dev_rwsem);
+  return mask;
+}
+
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
-    .read = aesd_read,
-    .write = aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+    // both go through the iter functions above, so data moves between the
+    // ring and pipe pages without a user space buffer
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open = aesd_open,
     .release = aesd_release,
     .llseek = aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap = aesd_mmap,
+    .poll = aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev) {
-  int err, devno = MKDEV(aesd_major, aesd_minor);
+static int aesd_setup_cdev(struct aesd_dev *dev, int index) {
+  int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
   cdev_init(&dev->cdev, &aesd_fops);
   dev->cdev.owner = THIS_MODULE;
   dev->cdev.ops = &aesd_fops;
   err = cdev_add(&dev->cdev, devno, 1);
   if (err) {
-    printk(KERN_ERR "Error %d adding aesd cdev", err);
+    printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
   }
   return err;
 }
 
+/**
+ * aesd_free_dev frees everything allocated for @param dev, which has no
+ * users left
+ */
+static void aesd_free_dev(struct aesd_dev *dev) {
+  // loop through the circular buffer and free each entry using the macro
+  struct aesd_buffer_entry *entry;
+  uint32_t i;
+  AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, i) {
+    if (NULL != entry->buffptr) {
+      kfree(entry->buffptr);
+      entry->buffptr = NULL;
+      entry->size = 0;
+    }
+  }
+  if (dev->buffer.entry != dev->buffer.inline_entry) {
+    kvfree(dev->buffer.entry);
+  }
+
+  // every mapping holds the device open, none are left at this point
+  vfree(dev->mmap_area);
+
+  // free the entry used for multiple read/writes
+  if (NULL != dev->working_entry.buffptr) {
+    kfree(dev->working_entry.buffptr);
+    dev->working_entry.buffptr = NULL;
+    dev->working_entry.size = 0;
+  }
+}
+
 int aesd_init_module(void) {
   dev_t dev = 0;
   int result;
-  result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+  uint i;
+
+  if (aesd_nr_devs < 1) {
+    printk(KERN_ERR "aesdchar: devices must be at least 1\n");
+    return -EINVAL;
+  }
+
+  result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs, "aesdchar");
   aesd_major = MAJOR(dev);
   if (result < 0) {
     printk(KERN_WARNING "Can't get major %d\n", aesd_major);
     return result;
   }
-  memset(&aesd_device, 0, sizeof(struct aesd_dev));
 
-  aesd_circular_buffer_init(&aesd_device.buffer);
-  mutex_init(&aesd_device.dev_mutex);
+  aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+  if (NULL == aesd_devices) {
+    unregister_chrdev_region(dev, aesd_nr_devs);
+    return -ENOMEM;
+  }
 
-  result = aesd_setup_cdev(&aesd_device);
+  for (i = 0; i < aesd_nr_devs; i++) {
+    struct aesd_dev *aesd_device = &aesd_devices[i];
 
-  if (result) {
-    unregister_chrdev_region(dev, 1);
-  }
-  return result;
-}
+    aesd_circular_buffer_init(&aesd_device->buffer);
+    init_rwsem(&aesd_device->dev_rwsem);
+    init_waitqueue_head(&aesd_device->readq);
 
-void aesd_cleanup_module(void) {
-  dev_t devno = MKDEV(aesd_major, aesd_minor);
+    result = aesd_mmap_setup(aesd_device);
+    if (result) {
+      goto fail;
+    }
 
-  cdev_del(&aesd_device.cdev);
+    if (ring_depth != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+      result = aesd_resize_ring(aesd_device, ring_depth);
+      if (result) {
+        printk(KERN_ERR "aesdchar: invalid ring_depth %u\n", ring_depth);
+        goto fail;
+      }
+    }
 
-  // loop through the circular buffer and free each entry using the macro
-  // struct aesd_buffer_entry *entry;
-  uint8_t i;
-  for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-    if (NULL != aesd_device.buffer.entry[i].buffptr) {
-      kfree(aesd_device.buffer.entry[i].buffptr);
-      aesd_device.buffer.entry[i].buffptr = NULL;
-      aesd_device.buffer.entry[i].buffptr = 0;
+    result = aesd_setup_cdev(aesd_device, i);
+    if (result) {
+      goto fail;
     }
   }
+  return 0;
 
-  // free the entry used for multiple read/writes
-  if (NULL != aesd_device.working_entry.buffptr) {
-    kfree(aesd_device.working_entry.buffptr);
-    aesd_device.working_entry.buffptr = NULL;
-    aesd_device.working_entry.size = 0;
+fail:
+  // the device that failed has no cdev, the ones before it do
+  aesd_free_dev(&aesd_devices[i]);
+  while (i-- > 0) {
+    cdev_del(&aesd_devices[i].cdev);
+    aesd_free_dev(&aesd_devices[i]);
   }
+  kfree(aesd_devices);
+  unregister_chrdev_region(dev, aesd_nr_devs);
+  return result;
+}
 
-  mutex_destroy(&aesd_device.dev_mutex);
+void aesd_cleanup_module(void) {
+  dev_t devno = MKDEV(aesd_major, aesd_minor);
+  uint i;
+
+  for (i = 0; i < aesd_nr_devs; i++) {
+    cdev_del(&aesd_devices[i].cdev);
+    aesd_free_dev(&aesd_devices[i]);
+  }
+  kfree(aesd_devices);
 
-  unregister_chrdev_region(devno, 1);
+  unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
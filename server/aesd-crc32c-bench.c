@@ -0,0 +1,64 @@
+/**
+ * @file aesd-crc32c-bench.c
+ * @brief Throughput of the CRC32C implementations, run with `make bench`
+ *
+ * Checksums a buffer of record sized pieces and a single large buffer with
+ * the table and the selected implementation and prints the cost per GB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aesd-crc32c.h"
+
+#define BENCH_BUF (64 * 1024 * 1024)
+#define BENCH_BYTES (2ULL * 1024 * 1024 * 1024)
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const void *buf, size_t len);
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * bench runs `fn` over BENCH_BYTES in `piece` sized calls and prints the
+ * result
+ */
+static void bench(const char *name, crc_fn fn, const uint8_t *buf,
+                  size_t piece) {
+  uint32_t crc = 0;
+  unsigned long long done = 0;
+  double start = now_s();
+  while (done < BENCH_BYTES) {
+    for (size_t off = 0; off + piece <= BENCH_BUF; off += piece) {
+      crc += fn(0, buf + off, piece);
+    }
+    done += BENCH_BUF - BENCH_BUF % piece;
+  }
+  double secs = now_s() - start;
+  double gb = done / (1024.0 * 1024 * 1024);
+  printf("%-8s %8zu byte pieces: %7.2f GB/s, %8.2f ms/GB (crc %08x)\n", name,
+         piece, gb / secs, secs * 1000 / gb, crc);
+}
+
+int main(void) {
+  uint8_t *buf = malloc(BENCH_BUF);
+  if (buf == NULL) {
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < BENCH_BUF; i++) {
+    buf[i] = rand();
+  }
+
+  const size_t pieces[] = {64, 4096, BENCH_BUF};
+  for (size_t i = 0; i < sizeof pieces / sizeof pieces[0]; i++) {
+    bench("table", aesd_crc32c_sw, buf, pieces[i]);
+    bench(aesd_crc32c_impl(), aesd_crc32c, buf, pieces[i]);
+  }
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,217 @@
+/**
+ * @file aesd-crc32c.c
+ * @brief CRC32C (Castagnoli) checksums for log records and replication frames
+ *
+ * The hardware versions feed the crc32 instruction 8 bytes at a time. The
+ * instruction has a latency of several cycles but can start one every cycle,
+ * so large buffers are split into three lanes checksummed side by side and
+ * the lane results are combined with a table that advances a crc over
+ * CRC_LANE zero bytes. The table version processes 8 bytes per step with
+ * eight 256 entry tables (slicing-by-8).
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#include "aesd-crc32c.h"
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78U
+
+// bytes per lane of the interleaved hardware loops
+#define CRC_LANE 1024
+
+static uint32_t crc_table[8][256];
+// crc_shift_table[k][b] advances the crc register byte k = b over CRC_LANE
+// zero bytes
+static uint32_t crc_shift_table[4][256];
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static crc32c_fn crc32c_best;
+static const char *crc32c_best_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof word);
+    // the tables assume little endian loads
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    word ^= crc;
+    crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+          crc_table[5][(word >> 16) & 0xff] ^
+          crc_table[4][(word >> 24) & 0xff] ^
+          crc_table[3][(word >> 32) & 0xff] ^
+          crc_table[2][(word >> 40) & 0xff] ^
+          crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  return crc;
+}
+
+/**
+ * crc_shift returns the raw crc register `crc` advanced over CRC_LANE zero
+ * bytes, so crc(A || B) = crc_shift(crc(A)) ^ crc_from_zero(B) for a B of
+ * CRC_LANE bytes
+ */
+static inline uint32_t crc_shift(uint32_t crc) {
+  return crc_shift_table[0][crc & 0xff] ^
+         crc_shift_table[1][(crc >> 8) & 0xff] ^
+         crc_shift_table[2][(crc >> 16) & 0xff] ^ crc_shift_table[3][crc >> 24];
+}
+
+static uint64_t load64(const uint8_t *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof word);
+  return word;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    len--;
+  }
+  uint64_t crc64 = crc;
+  while (len >= 3 * CRC_LANE) {
+    uint64_t crc_b = 0;
+    uint64_t crc_c = 0;
+    for (size_t i = 0; i < CRC_LANE; i += 8) {
+      crc64 = _mm_crc32_u64(crc64, load64(p + i));
+      crc_b = _mm_crc32_u64(crc_b, load64(p + CRC_LANE + i));
+      crc_c = _mm_crc32_u64(crc_c, load64(p + 2 * CRC_LANE + i));
+    }
+    crc64 = crc_shift(crc_shift(crc64) ^ crc_b) ^ crc_c;
+    p += 3 * CRC_LANE;
+    len -= 3 * CRC_LANE;
+  }
+  while (len >= 8) {
+    crc64 = _mm_crc32_u64(crc64, load64(p));
+    p += 8;
+    len -= 8;
+  }
+  crc = crc64;
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    len--;
+  }
+  return crc;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc"))) static uint32_t
+crc32c_armv8(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = __crc32cb(crc, *p++);
+    len--;
+  }
+  while (len >= 3 * CRC_LANE) {
+    uint32_t crc_b = 0;
+    uint32_t crc_c = 0;
+    for (size_t i = 0; i < CRC_LANE; i += 8) {
+      crc = __crc32cd(crc, load64(p + i));
+      crc_b = __crc32cd(crc_b, load64(p + CRC_LANE + i));
+      crc_c = __crc32cd(crc_c, load64(p + 2 * CRC_LANE + i));
+    }
+    crc = crc_shift(crc_shift(crc) ^ crc_b) ^ crc_c;
+    p += 3 * CRC_LANE;
+    len -= 3 * CRC_LANE;
+  }
+  while (len >= 8) {
+    crc = __crc32cd(crc, load64(p));
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = __crc32cb(crc, *p++);
+    len--;
+  }
+  return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+    }
+    crc_table[0][i] = crc;
+  }
+  for (int t = 1; t < 8; t++) {
+    for (int i = 0; i < 256; i++) {
+      uint32_t prev = crc_table[t - 1][i];
+      crc_table[t][i] = crc_table[0][prev & 0xff] ^ (prev >> 8);
+    }
+  }
+
+  // the register is linear, so shifting any value is the xor of the shifts
+  // of its set bits
+  static const uint8_t zeros[CRC_LANE];
+  uint32_t bit_shift[32];
+  for (int bit = 0; bit < 32; bit++) {
+    bit_shift[bit] = crc32c_table(1U << bit, zeros, CRC_LANE);
+  }
+  for (int k = 0; k < 4; k++) {
+    for (int b = 0; b < 256; b++) {
+      uint32_t shifted = 0;
+      for (int bit = 0; bit < 8; bit++) {
+        if (b & (1 << bit)) {
+          shifted ^= bit_shift[8 * k + bit];
+        }
+      }
+      crc_shift_table[k][b] = shifted;
+    }
+  }
+
+  crc32c_best = crc32c_table;
+  crc32c_best_name = "table";
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_best = crc32c_sse42;
+    crc32c_best_name = "sse4.2";
+  }
+#elif defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    crc32c_best = crc32c_armv8;
+    crc32c_best_name = "armv8";
+  }
+#endif
+}
+
+uint32_t aesd_crc32c(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_best(~crc, buf, len);
+}
+
+uint32_t aesd_crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_table(~crc, buf, len);
+}
+
+const char *aesd_crc32c_impl(void) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return crc32c_best_name;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file aesd-crc32c.h
+ * @brief CRC32C (Castagnoli) checksums for log records and replication frames
+ *
+ * Uses the SSE4.2 crc32 instruction on x86-64 and the ARMv8 CRC32 extension
+ * on aarch64 when the cpu has them, a slicing-by-8 table otherwise. All
+ * implementations give the same result, the one used is picked on the first
+ * call.
+ */
+
+#ifndef AESD_CRC32C_H
+#define AESD_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Extends the checksum @param crc (0 to start) with @param len bytes from
+ * @param buf, so a checksum can be built from several pieces
+ * @return the CRC32C of everything seen so far
+ */
+uint32_t aesd_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Same as aesd_crc32c(), always using the table implementation
+ */
+uint32_t aesd_crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @return the name of the implementation aesd_crc32c() uses
+ */
+const char *aesd_crc32c_impl(void);
+
+#endif /* AESD_CRC32C_H */
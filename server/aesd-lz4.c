@@ -0,0 +1,139 @@
+/**
+ * @file aesd-lz4.c
+ * @brief Minimal LZ4 block format codec used for compressed replays
+ *
+ * Greedy single-pass compressor with a 4K entry hash table, the same
+ * approach as the reference LZ4_compress_fast() at acceleration 1, without
+ * its unaligned access tricks.
+ */
+
+#include <string.h>
+
+#include "aesd-lz4.h"
+
+#define MINMATCH 4
+// the last match must start at least this many bytes before the end
+#define MFLIMIT 12
+// the last bytes of a block are always literals
+#define LASTLITERALS 5
+#define MAX_DISTANCE 65535
+#define HASH_LOG 12
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t val;
+  memcpy(&val, p, sizeof val);
+  return val;
+}
+
+static uint32_t hash32(uint32_t seq) {
+  return (seq * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/**
+ * write_length appends the 255 continuation bytes used for literal and match
+ * lengths that do not fit in their 4 bit token field
+ */
+static uint8_t *write_length(uint8_t *op, const uint8_t *oend, size_t len) {
+  while (len >= 255) {
+    if (op >= oend) {
+      return NULL;
+    }
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op >= oend) {
+    return NULL;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/**
+ * write_sequence emits one token, its literals and, when @param match_len is
+ * not 0, the match offset and length
+ */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend,
+                               const uint8_t *literals, size_t lit_len,
+                               size_t offset, size_t match_len) {
+  if (op >= oend) {
+    return NULL;
+  }
+  uint8_t *token = op++;
+  size_t ml = match_len ? match_len - MINMATCH : 0;
+
+  *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+  if (lit_len >= 15 && (op = write_length(op, oend, lit_len - 15)) == NULL) {
+    return NULL;
+  }
+  if ((size_t)(oend - op) < lit_len) {
+    return NULL;
+  }
+  memcpy(op, literals, lit_len);
+  op += lit_len;
+
+  if (match_len == 0) {
+    return op;
+  }
+  if (oend - op < 2) {
+    return NULL;
+  }
+  *op++ = (uint8_t)(offset & 0xff);
+  *op++ = (uint8_t)(offset >> 8);
+  *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+  if (ml >= 15 && (op = write_length(op, oend, ml - 15)) == NULL) {
+    return NULL;
+  }
+  return op;
+}
+
+size_t aesd_lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                         size_t dst_cap) {
+  uint32_t table[1 << HASH_LOG];
+  const uint8_t *oend = dst + dst_cap;
+  uint8_t *op = dst;
+  size_t anchor = 0;
+
+  if (src_len > MFLIMIT) {
+    const size_t limit = src_len - MFLIMIT;
+    const size_t match_limit = src_len - LASTLITERALS;
+    size_t ip = 1;
+
+    memset(table, 0, sizeof table);
+    while (ip < limit) {
+      uint32_t seq = read32(src + ip);
+      uint32_t h = hash32(seq);
+      size_t ref = table[h];
+      table[h] = (uint32_t)ip;
+
+      if (ip - ref > MAX_DISTANCE || read32(src + ref) != seq) {
+        ip++;
+        continue;
+      }
+
+      size_t match_len = MINMATCH;
+      while (ip + match_len < match_limit &&
+             src[ref + match_len] == src[ip + match_len]) {
+        match_len++;
+      }
+
+      op = write_sequence(op, oend, src + anchor, ip - anchor, ip - ref,
+                          match_len);
+      if (op == NULL) {
+        return 0;
+      }
+      ip += match_len;
+      anchor = ip;
+      if (ip < limit) {
+        // seed the table with the end of the match, long runs compress
+        // much better this way
+        table[hash32(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+      }
+    }
+  }
+
+  op = write_sequence(op, oend, src + anchor, src_len - anchor, 0, 0);
+  if (op == NULL) {
+    return 0;
+  }
+  return op - dst;
+}
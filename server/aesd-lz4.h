@@ -0,0 +1,28 @@
+/**
+ * @file aesd-lz4.h
+ * @brief Minimal LZ4 block format codec used for compressed replays
+ *
+ * Output is a raw LZ4 block (no frame header, no checksum), so it can be
+ * decoded by any LZ4 implementation, e.g. LZ4_decompress_safe() or
+ * lz4.block.decompress(data, uncompressed_size=n) in python.
+ */
+
+#ifndef AESD_LZ4_H
+#define AESD_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Worst case compressed size for @param src_len input bytes
+ */
+#define AESD_LZ4_BOUND(src_len) ((src_len) + ((src_len) / 255) + 16)
+
+/**
+ * Compresses @param src_len bytes from @param src into @param dst
+ * @return the compressed size, or 0 if it does not fit in @param dst_cap
+ */
+size_t aesd_lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                         size_t dst_cap);
+
+#endif /* AESD_LZ4_H */
@@ -0,0 +1,60 @@
+/**
+ * @file aesdsocket-trace.h
+ * @brief USDT probes for aesdsocket
+ *
+ * When <sys/sdt.h> is available (systemtap-sdt-dev / systemtap-sdt-devel)
+ * the Makefile defines HAVE_SYS_SDT_H and every AESD_TRACE* call becomes a
+ * static probe in the "aesdsocket" provider. A probe is a single nop until a
+ * tracer attaches to it, e.g.
+ *
+ *   bpftrace -e 'usdt:./aesdsocket:aesdsocket:append { @[arg2] = hist(arg3); }'
+ *   perf buildid-cache --add ./aesdsocket && perf list sdt_aesdsocket:*
+ *
+ * Without the header the probes compile to nothing.
+ *
+ * Probes (arguments in order):
+ *   recv          clientfd, bytes received
+ *   lock_acquire  log, clientfd           (before waiting for the log lock)
+ *   lock_acquired log, clientfd
+ *   lock_release  log, clientfd
+ *   append        clientfd, log, offset (-1 for the char device), bytes
+ *   replay_start  clientfd, log, log size (-1 for the char device)
+ *   replay_end    clientfd, log, bytes sent
+ *   send          clientfd, bytes
+ */
+
+#ifndef AESDSOCKET_TRACE_H
+#define AESDSOCKET_TRACE_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define AESD_TRACE2(name, a1, a2) DTRACE_PROBE2(aesdsocket, name, a1, a2)
+#define AESD_TRACE3(name, a1, a2, a3)                                          \
+  DTRACE_PROBE3(aesdsocket, name, a1, a2, a3)
+#define AESD_TRACE4(name, a1, a2, a3, a4)                                      \
+  DTRACE_PROBE4(aesdsocket, name, a1, a2, a3, a4)
+#else
+// arguments are still referenced so variables kept only for tracing do not
+// trigger unused warnings, they have no side effects and are optimized out
+#define AESD_TRACE2(name, a1, a2)                                              \
+  do {                                                                         \
+    (void)(a1);                                                                \
+    (void)(a2);                                                                \
+  } while (0)
+#define AESD_TRACE3(name, a1, a2, a3)                                          \
+  do {                                                                         \
+    (void)(a1);                                                                \
+    (void)(a2);                                                                \
+    (void)(a3);                                                                \
+  } while (0)
+#define AESD_TRACE4(name, a1, a2, a3, a4)                                      \
+  do {                                                                         \
+    (void)(a1);                                                                \
+    (void)(a2);                                                                \
+    (void)(a3);                                                                \
+    (void)(a4);                                                                \
+  } while (0)
+#endif
+
+#endif /* AESDSOCKET_TRACE_H */
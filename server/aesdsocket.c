@@ -1,23 +1,42 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <asm-generic/socket.h>
 #include <bits/time.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syslog.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "aesd-crc32c.h"
+#include "aesd-lz4.h"
+#include "aesdsocket-trace.h"
+
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
 #endif
@@ -36,141 +55,3414 @@
 
 #define BUFSIZE 4096
 
+// the log and the port to listen on, -f and -p change them
+const char *log_path = AESDFILE;
+const char *listen_port = PORT;
+// -k keeps the log files and their checkpoints across restarts
+bool persistent = false;
+// -C frames every record of a log file with its length and CRC32C
+bool framed = false;
+// -u adds a local (AF_UNIX) listener at this path
+char local_path[PATH_MAX];
+
 volatile sig_atomic_t shutdown_flag = 0;
+volatile sig_atomic_t stats_flag = 0;
 
 // start client thread and file
+
+/**
+ * fair_lock is a FIFO ticket lock guarding a log
+ *
+ * A plain mutex lets the thread that just released it take it straight back,
+ * so one producer sending packets back to back can starve the others. With
+ * tickets, every connection already waiting gets its turn before the
+ * releasing one gets the lock again.
+ */
+struct fair_lock {
+  pthread_mutex_t mut;
+  pthread_cond_t turn;
+  unsigned long next_ticket;
+  unsigned long now_serving;
+};
+
+int fair_lock_init(struct fair_lock *lock) {
+  lock->next_ticket = 0;
+  lock->now_serving = 0;
+  if (pthread_mutex_init(&lock->mut, NULL) != 0) {
+    return -1;
+  }
+  if (pthread_cond_init(&lock->turn, NULL) != 0) {
+    pthread_mutex_destroy(&lock->mut);
+    return -1;
+  }
+  return 0;
+}
+
+void fair_lock_destroy(struct fair_lock *lock) {
+  pthread_cond_destroy(&lock->turn);
+  pthread_mutex_destroy(&lock->mut);
+}
+
+void fair_lock_acquire(struct fair_lock *lock) {
+  pthread_mutex_lock(&lock->mut);
+  unsigned long ticket = lock->next_ticket++;
+  while (lock->now_serving != ticket) {
+    pthread_cond_wait(&lock->turn, &lock->mut);
+  }
+  pthread_mutex_unlock(&lock->mut);
+}
+
+void fair_lock_release(struct fair_lock *lock) {
+  pthread_mutex_lock(&lock->mut);
+  lock->now_serving++;
+  pthread_cond_broadcast(&lock->turn);
+  pthread_mutex_unlock(&lock->mut);
+}
+
+/**
+ * replay_block is the cached compressed replay frame of one full
+ * REPLAY_BLOCK_SIZE block of the log file
+ */
+struct replay_block {
+  uint8_t *frame;
+  size_t frame_len;
+};
+
 struct file_with_lock {
-  pthread_mutex_t file_mut;
+  struct fair_lock file_mut;
   FILE *file;
+  char path[PATH_MAX];
+  // bytes appended to the log so far
+  off_t size;
+
+  // file offset where every complete (newline terminated) record starts, in
+  // append order, record i ends where record i + 1 starts and the last one
+  // ends at `record_end`, which is also where the next record will start
+  off_t *records;
+  size_t record_count;
+  size_t record_cap;
+  off_t record_end;
+  // CRC32C of every complete record, next to `records`, and the running
+  // CRC32C of the record being assembled after `record_end`
+  uint32_t *record_crcs;
+  uint32_t record_crc;
+
+  // framed logs only: the start of a record whose newline has not arrived
+  // yet, it is written out as one frame once it is complete
+  char *pending;
+  size_t pending_len;
+  size_t pending_cap;
+
+  // `committed` mirrors `record_end` for readers that do not hold the log
+  // lock, replication streams wait on `grow_cond` for it to move
+  pthread_mutex_t grow_mut;
+  pthread_cond_t grow_cond;
+  off_t committed;
+  // checkpoint file of the log and the number of records it holds,
+  // persistent mode only, `ckpt_fd` is -1 when there is none
+  int ckpt_fd;
+  size_t checkpointed;
+
+  // compressed frames of the full blocks at the start of the log, built on
+  // the first compressed replay that reaches them and shared by every client
+  // afterwards, the log is append only so a full block never changes. Blocks
+  // past REPLAY_CACHE_MAX bytes of frames are compressed per replay instead.
+  struct replay_block *blocks;
+  size_t block_count;
+  size_t block_cap;
+  size_t block_bytes;
+  unsigned long blocks_compressed;
+  unsigned long blocks_reused;
+};
+
+struct file_with_lock *fwl;
+
+/**
+ * pwrite_full writes `len` bytes at `offset`, retrying short writes
+ *
+ * Returns 0 on success, -1 on error
+ */
+int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t put = pwrite(fd, p, len, offset);
+    if (put == -1 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      return -1;
+    }
+    p += put;
+    len -= put;
+    offset += put;
+  }
+  return 0;
+}
+
+/**
+ * pread_full reads `len` bytes at `offset`, retrying short reads
+ *
+ * Returns 0 on success, -1 on error or early end of file
+ */
+int pread_full(int fd, void *buf, size_t len, off_t offset) {
+  uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t got = pread(fd, p, len, offset);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    p += got;
+    len -= got;
+    offset += got;
+  }
+  return 0;
+}
+
+/**
+ * With -C a log file starts with LOG_FRAME_MAGIC and holds every record as a
+ * frame of its own:
+ *
+ *   uint32_t len   length of the record, native byte order
+ *   uint32_t crc   CRC32C of the record
+ *   len bytes      the record, ending with its newline
+ *
+ * Offsets everywhere else (the index, `size`, replication, queries) count
+ * record bytes only, log_file_offset turns them into file offsets.
+ */
+#define LOG_FRAME_MAGIC "AESDFRM1"
+#define LOG_FRAME_MAGIC_LEN 8
+#define LOG_FRAME_HDR 8
+
+/**
+ * log_file_offset returns where the record byte at `offset` is in the log
+ * file, `frames` being the number of frame headers before it: the index of
+ * its record plus one, or the record count for the end of the log
+ */
+off_t log_file_offset(off_t offset, size_t frames) {
+  if (!framed) {
+    return offset;
+  }
+  return LOG_FRAME_MAGIC_LEN + offset + (off_t)frames * LOG_FRAME_HDR;
+}
+
+/**
+ * file_with_lock_add_record adds the record ending at `end`, with CRC32C
+ * `crc`, to the record index
+ *
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns 0 on success, -1 if the index could not grow
+ */
+int file_with_lock_add_record(struct file_with_lock *fwl, off_t end,
+                              uint32_t crc) {
+  if (fwl->record_count == fwl->record_cap) {
+    size_t cap = fwl->record_cap ? fwl->record_cap * 2 : 1024;
+    off_t *records = realloc(fwl->records, cap * sizeof(off_t));
+    if (records == NULL) {
+      return -1;
+    }
+    fwl->records = records;
+    uint32_t *crcs = realloc(fwl->record_crcs, cap * sizeof(uint32_t));
+    if (crcs == NULL) {
+      return -1;
+    }
+    fwl->record_crcs = crcs;
+    fwl->record_cap = cap;
+  }
+  fwl->record_crcs[fwl->record_count] = crc;
+  fwl->records[fwl->record_count++] = fwl->record_end;
+  fwl->record_end = end;
+  return 0;
+}
+
+/**
+ * file_with_lock_index adds the records completed by `len` bytes just
+ * appended at offset `offset` to the record index
+ *
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns 0 on success, -1 if the index could not grow
+ */
+int file_with_lock_index(struct file_with_lock *fwl, const char *data,
+                         size_t len, off_t offset) {
+  const char *p = data;
+  const char *end = data + len;
+  const char *newline;
+  while ((newline = memchr(p, '\n', end - p)) != NULL) {
+    if (file_with_lock_add_record(
+            fwl, offset + (newline - data) + 1,
+            aesd_crc32c(fwl->record_crc, p, newline - p + 1)) == -1) {
+      return -1;
+    }
+    fwl->record_crc = 0;
+    p = newline + 1;
+  }
+  fwl->record_crc = aesd_crc32c(fwl->record_crc, p, end - p);
+  return 0;
+}
+
+/**
+ * file_with_lock_publish makes `record_end` visible to readers that do not
+ * hold the log lock and wakes up waiting replication streams
+ *
+ * Must be called with `fwl->file_mut` held.
+ */
+void file_with_lock_publish(struct file_with_lock *fwl) {
+  pthread_mutex_lock(&fwl->grow_mut);
+  fwl->committed = fwl->record_end;
+  pthread_cond_broadcast(&fwl->grow_cond);
+  pthread_mutex_unlock(&fwl->grow_mut);
+}
+
+/**
+ * file_with_lock_appended accounts for `len` bytes (`data`) that were just
+ * written to the end of the log at `offset`: they are indexed and waiting
+ * replication streams are woken up if records were completed
+ *
+ * Must be called with `fwl->file_mut` held.
+ */
+void file_with_lock_appended(struct file_with_lock *fwl, const char *data,
+                             size_t len, off_t offset) {
+  fwl->size += len;
+  off_t record_end = fwl->record_end;
+  if (file_with_lock_index(fwl, data, len, offset) == -1) {
+    syslog(LOG_ERR, "Error growing the record index of %s", fwl->path);
+  }
+  if (fwl->record_end != record_end) {
+    file_with_lock_publish(fwl);
+  }
+}
+
+/**
+ * file_with_lock_reserve_pending makes room for `len` bytes of an unfinished
+ * record in `fwl->pending`, keeping what it holds
+ *
+ * Returns 0 on success, -1 on error or if no frame could hold the record
+ */
+int file_with_lock_reserve_pending(struct file_with_lock *fwl, size_t len) {
+  if (len > UINT32_MAX) {
+    return -1;
+  }
+  if (len <= fwl->pending_cap) {
+    return 0;
+  }
+  size_t cap = fwl->pending_cap ? fwl->pending_cap : BUFSIZE;
+  while (cap < len) {
+    cap *= 2;
+  }
+  char *pending = realloc(fwl->pending, cap);
+  if (pending == NULL) {
+    return -1;
+  }
+  fwl->pending = pending;
+  fwl->pending_cap = cap;
+  return 0;
+}
+
+/**
+ * file_with_lock_append_framed writes the records completed by `len` bytes
+ * (`data`) to a framed log, one frame each, and keeps the start of a record
+ * still missing its newline in memory until it arrives
+ *
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns 0 on success, -1 on error, in which case nothing of `data` is kept
+ */
+int file_with_lock_append_framed(struct file_with_lock *fwl, const char *data,
+                                 size_t len) {
+  const char *end = data + len;
+  const char *p = data;
+  const char *newline;
+  size_t frames = 0;
+  while ((newline = memchr(p, '\n', end - p)) != NULL) {
+    frames++;
+    p = newline + 1;
+  }
+  const char *tail = p;
+  size_t tail_len = end - tail;
+  if (frames == 0) {
+    if (file_with_lock_reserve_pending(fwl, fwl->pending_len + len) == -1) {
+      return -1;
+    }
+    memcpy(fwl->pending + fwl->pending_len, data, len);
+    fwl->pending_len += len;
+    return 0;
+  }
+
+  size_t total = fwl->pending_len + (tail - data) + frames * LOG_FRAME_HDR;
+  char *buf = malloc(total);
+  if (buf == NULL) {
+    return -1;
+  }
+  char *out = buf;
+  size_t prefix = fwl->pending_len;
+  uint32_t hdr[2];
+  for (p = data; p < tail; p = newline + 1) {
+    newline = memchr(p, '\n', tail - p);
+    size_t rec_len = prefix + (newline - p) + 1;
+    if (rec_len > UINT32_MAX) {
+      free(buf);
+      return -1;
+    }
+    char *rec = out + LOG_FRAME_HDR;
+    if (prefix > 0) {
+      memcpy(rec, fwl->pending, prefix);
+    }
+    memcpy(rec + prefix, p, rec_len - prefix);
+    hdr[0] = rec_len;
+    hdr[1] = aesd_crc32c(0, rec, rec_len);
+    memcpy(out, hdr, sizeof hdr);
+    out += LOG_FRAME_HDR + rec_len;
+    prefix = 0;
+  }
+  // the pending bytes are in `buf` now, so `pending` can take the new tail
+  if (file_with_lock_reserve_pending(fwl, tail_len) == -1) {
+    free(buf);
+    return -1;
+  }
+
+  int fd = fileno(fwl->file);
+  off_t at = log_file_offset(fwl->size, fwl->record_count);
+  if (pwrite_full(fd, buf, total, at) == -1) {
+    // whatever part of the frames made it would be torn
+    if (ftruncate(fd, at) == -1) {
+      syslog(LOG_ERR, "Error dropping a torn frame from %s", fwl->path);
+    }
+    free(buf);
+    return -1;
+  }
+
+  // the CRC32C of every record is in its header already
+  fwl->size += fwl->pending_len + (tail - data);
+  for (out = buf; out < buf + total; out += LOG_FRAME_HDR + hdr[0]) {
+    memcpy(hdr, out, sizeof hdr);
+    if (file_with_lock_add_record(fwl, fwl->record_end + hdr[0], hdr[1]) ==
+        -1) {
+      syslog(LOG_ERR, "Error growing the record index of %s", fwl->path);
+      break;
+    }
+  }
+  file_with_lock_publish(fwl);
+  free(buf);
+  if (tail_len > 0) {
+    memcpy(fwl->pending, tail, tail_len);
+  }
+  fwl->pending_len = tail_len;
+  return 0;
+}
+
+/**
+ * file_with_lock_append writes `len` bytes to the end of the log, flushes
+ * them to the file and indexes the records they complete
+ *
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int file_with_lock_append(struct file_with_lock *fwl, const char *data,
+                          size_t len) {
+  if (framed) {
+    return file_with_lock_append_framed(fwl, data, len);
+  }
+  off_t offset = fwl->size;
+  if (fwrite(data, sizeof(char), len, fwl->file) != len) {
+    return -1;
+  }
+  // fflush is here to force the file to be written and not stored
+  // in the kernel buffer
+  fflush(fwl->file);
+  file_with_lock_appended(fwl, data, len, offset);
+  return 0;
+}
+
+/**
+ * file_with_lock_record_span turns the record numbers `first`..`last`
+ * (inclusive, negative numbers count back from the newest record, -1 being
+ * the newest) into a byte range of the log
+ *
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns 0 and sets `start`/`len`, or -1 if the range holds no records
+ */
+int file_with_lock_record_span(struct file_with_lock *fwl, long long first,
+                               long long last, off_t *start, size_t *len) {
+  long long count = fwl->record_count;
+  if (first < 0) {
+    first += count;
+  }
+  if (last < 0) {
+    last += count;
+  }
+  if (first < 0) {
+    first = 0;
+  }
+  if (last >= count) {
+    last = count - 1;
+  }
+  if (count == 0 || first > last) {
+    return -1;
+  }
+  off_t end = (last + 1 < count) ? fwl->records[last + 1] : fwl->record_end;
+  *start = fwl->records[first];
+  *len = end - *start;
+  return 0;
+}
+
+/**
+ * log_cursor walks the record bytes of a log file, stepping over the frame
+ * headers of a framed log
+ */
+struct log_cursor {
+  // file offset of the next byte to read
+  off_t pos;
+  // record bytes left before the next frame header, framed logs only
+  size_t left;
+};
+
+/**
+ * log_cursor_at points `cur` at byte `offset` of the log
+ *
+ * Must be called with `fwl->file_mut` held. The cursor can then be read
+ * without it, up to the size of the log at the time.
+ */
+void log_cursor_at(struct file_with_lock *fwl, off_t offset,
+                   struct log_cursor *cur) {
+  cur->pos = offset;
+  cur->left = SIZE_MAX;
+  if (!framed) {
+    return;
+  }
+  // number of records starting at or before `offset`
+  size_t lo = 0;
+  size_t hi = fwl->record_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (fwl->records[mid] <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || offset >= fwl->record_end) {
+    cur->pos = log_file_offset(fwl->record_end, fwl->record_count);
+    cur->left = 0;
+    return;
+  }
+  off_t end = (lo < fwl->record_count) ? fwl->records[lo] : fwl->record_end;
+  cur->pos = log_file_offset(offset, lo);
+  cur->left = end - offset;
+}
+
+/**
+ * log_cursor_read reads the next `len` record bytes at `cur` into `buf`
+ *
+ * The file bytes are read straight into `buf` and the frame headers among
+ * them are squeezed out in place.
+ *
+ * Returns 0 on success, -1 on a read error or a malformed frame
+ */
+int log_cursor_read(struct file_with_lock *fwl, struct log_cursor *cur,
+                    void *buf, size_t len) {
+  int fd = fileno(fwl->file);
+  if (!framed) {
+    if (pread_full(fd, buf, len, cur->pos) == -1) {
+      return -1;
+    }
+    cur->pos += len;
+    return 0;
+  }
+  uint8_t *out = buf;
+  size_t got = 0;
+  while (got < len) {
+    off_t pos = cur->pos;
+    if (cur->left == 0 && len - got < LOG_FRAME_HDR) {
+      // no room for the header next to the record bytes still wanted
+      uint32_t hdr[2];
+      if (pread_full(fd, hdr, sizeof hdr, cur->pos) == -1 || hdr[0] == 0) {
+        return -1;
+      }
+      cur->pos += LOG_FRAME_HDR;
+      cur->left = hdr[0];
+      continue;
+    }
+    ssize_t n = pread(fd, out + got, len - got, cur->pos);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    uint8_t *in = out + got;
+    uint8_t *in_end = in + n;
+    uint8_t *dst = in;
+    while (in < in_end) {
+      if (cur->left == 0) {
+        // a header cut off by the end of the read is read again next round
+        if (in_end - in < LOG_FRAME_HDR) {
+          break;
+        }
+        uint32_t rec_len;
+        memcpy(&rec_len, in, sizeof rec_len);
+        if (rec_len == 0) {
+          return -1;
+        }
+        cur->left = rec_len;
+        cur->pos += LOG_FRAME_HDR;
+        in += LOG_FRAME_HDR;
+        continue;
+      }
+      size_t take = in_end - in;
+      if (take > cur->left) {
+        take = cur->left;
+      }
+      memmove(dst, in, take);
+      dst += take;
+      in += take;
+      cur->pos += take;
+      cur->left -= take;
+    }
+    if (cur->pos == pos) {
+      // the file ends inside a header
+      return -1;
+    }
+    got = dst - out;
+  }
+  return 0;
+}
+
+/**
+ * log_pread reads `len` bytes of the log at `offset` into `buf`
+ *
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int log_pread(struct file_with_lock *fwl, void *buf, size_t len,
+              off_t offset) {
+  struct log_cursor cur;
+  log_cursor_at(fwl, offset, &cur);
+  return log_cursor_read(fwl, &cur, buf, len);
+}
+
+// start persistence
+
+#define CHECKPOINT_MAGIC "AESDCKP3"
+#define CHECKPOINT_MAGIC_LEN 8
+#define CHECKPOINT_INTERVAL_S 5
+#define RECOVER_CHUNK (64 * 1024)
+
+/**
+ * log_checkpoint_entry describes one complete record in <log path>.ckpt,
+ * which holds CHECKPOINT_MAGIC followed by one entry per record, in order
+ *
+ * Record i starts where record i - 1 ends and the first one at 0, so the
+ * last entry also gives the committed size, and the number of entries is the
+ * next sequence number. Entries are only ever appended: each checkpoint
+ * writes the records completed since the previous one. A crash during an
+ * append leaves a torn or zeroed tail, which is dropped on load because the
+ * ends stop growing. The file is only read back by the host that wrote it
+ * and uses the native byte order.
+ */
+struct log_checkpoint_entry {
+  uint64_t end;
+  uint32_t crc;
+  uint32_t reserved;
+};
+
+/**
+ * file_with_lock_checkpoint appends the records completed since the last
+ * checkpoint to <path>.ckpt and syncs it
+ *
+ * Nothing is written if no record was completed since the last checkpoint.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int file_with_lock_checkpoint(struct file_with_lock *fwl) {
+  // the index only ever grows, but it may move when it does, so copy the
+  // new part and write it out without holding the log lock
+  fair_lock_acquire(&fwl->file_mut);
+  size_t first = fwl->checkpointed;
+  size_t count = fwl->record_count - first;
+  if (fwl->ckpt_fd == -1 || count == 0) {
+    fair_lock_release(&fwl->file_mut);
+    return 0;
+  }
+  struct log_checkpoint_entry *entries = calloc(count, sizeof(*entries));
+  if (entries == NULL) {
+    fair_lock_release(&fwl->file_mut);
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t rec = first + i;
+    entries[i].end = (rec + 1 < fwl->record_count) ? fwl->records[rec + 1]
+                                                   : fwl->record_end;
+    entries[i].crc = fwl->record_crcs[rec];
+  }
+  fair_lock_release(&fwl->file_mut);
+
+  int ret = -1;
+  off_t at = CHECKPOINT_MAGIC_LEN + first * sizeof(*entries);
+  if (pwrite_full(fwl->ckpt_fd, entries, count * sizeof(*entries), at) == 0 &&
+      fdatasync(fwl->ckpt_fd) == 0) {
+    // only the checkpoint thread, or shutdown once it is gone, writes this
+    fwl->checkpointed = first + count;
+    ret = 0;
+  } else {
+    // the next checkpoint writes the same entries over the torn ones
+    syslog(LOG_ERR, "Error writing the checkpoint of %s", fwl->path);
+  }
+  free(entries);
+  return ret;
+}
+
+/**
+ * file_with_lock_span_crc computes the CRC32C of file offsets `start` to
+ * `end` of the log file
+ *
+ * Returns 0 and sets `crc` on success, -1 on a read error
+ */
+int file_with_lock_span_crc(struct file_with_lock *fwl, off_t start, off_t end,
+                            uint32_t *crc) {
+  char *chunk = malloc(RECOVER_CHUNK);
+  if (chunk == NULL) {
+    return -1;
+  }
+  *crc = 0;
+  while (start < end) {
+    size_t len = end - start;
+    if (len > RECOVER_CHUNK) {
+      len = RECOVER_CHUNK;
+    }
+    if (pread_full(fileno(fwl->file), chunk, len, start) == -1) {
+      free(chunk);
+      return -1;
+    }
+    *crc = aesd_crc32c(*crc, chunk, len);
+    start += len;
+  }
+  free(chunk);
+  return 0;
+}
+
+/**
+ * file_with_lock_load_checkpoint opens <path>.ckpt and restores the record
+ * index from the entries that fit in a log file of `size` bytes
+ *
+ * The last record kept is read back and checked against its CRC32C, a
+ * mismatch means the file was changed or torn underneath the checkpoint and
+ * the checkpoint is started over.
+ *
+ * Returns the offset up to which the log is indexed, 0 if there is no usable
+ * checkpoint, -1 if the checkpoint file cannot be set up
+ */
+off_t file_with_lock_load_checkpoint(struct file_with_lock *fwl, off_t size) {
+  char path[PATH_MAX + 8];
+  snprintf(path, sizeof path, "%s.ckpt", fwl->path);
+  fwl->ckpt_fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fwl->ckpt_fd == -1) {
+    syslog(LOG_ERR, "Error opening checkpoint %s", path);
+    return -1;
+  }
+
+  struct stat st = {0};
+  char magic[CHECKPOINT_MAGIC_LEN];
+  struct log_checkpoint_entry *entries = NULL;
+  size_t count = 0;
+  bool ok = fstat(fwl->ckpt_fd, &st) == 0 &&
+            st.st_size >= (off_t)sizeof magic &&
+            pread_full(fwl->ckpt_fd, magic, sizeof magic, 0) == 0 &&
+            memcmp(magic, CHECKPOINT_MAGIC, sizeof magic) == 0;
+  if (ok) {
+    count = (st.st_size - sizeof magic) / sizeof(*entries);
+    entries = malloc(count * sizeof(*entries) + 1);
+    ok = entries != NULL &&
+         pread_full(fwl->ckpt_fd, entries, count * sizeof(*entries),
+                    sizeof magic) == 0;
+  }
+
+  // a torn append stops the ends from growing, and entries past the end of
+  // the log describe data it lost
+  size_t kept = 0;
+  uint64_t end = 0;
+  while (ok && kept < count && entries[kept].end > end &&
+         entries[kept].end <= (uint64_t)size &&
+         log_file_offset(entries[kept].end, kept + 1) <= size) {
+    end = entries[kept++].end;
+  }
+  off_t *records = NULL;
+  uint32_t *crcs = NULL;
+  if (ok && kept > 0) {
+    records = malloc(kept * sizeof(off_t));
+    crcs = malloc(kept * sizeof(uint32_t));
+    ok = records != NULL && crcs != NULL;
+    for (size_t i = 0; ok && i < kept; i++) {
+      records[i] = (i > 0) ? (off_t)entries[i - 1].end : 0;
+      crcs[i] = entries[i].crc;
+    }
+    uint32_t last_crc;
+    ok = ok &&
+         file_with_lock_span_crc(fwl, log_file_offset(records[kept - 1], kept),
+                                 log_file_offset(end, kept), &last_crc) == 0 &&
+         last_crc == crcs[kept - 1];
+  }
+  free(entries);
+
+  if (!ok) {
+    if (st.st_size > 0) {
+      syslog(LOG_ERR, "Ignoring stale checkpoint %s", path);
+    }
+    free(records);
+    free(crcs);
+    if (ftruncate(fwl->ckpt_fd, 0) == -1 ||
+        pwrite_full(fwl->ckpt_fd, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN, 0) ==
+            -1) {
+      syslog(LOG_ERR, "Error resetting checkpoint %s", path);
+      return -1;
+    }
+    return 0;
+  }
+  // the next checkpoint appends right after the last entry kept
+  if (kept < count &&
+      ftruncate(fwl->ckpt_fd, sizeof magic + kept * sizeof(*entries)) == -1) {
+    syslog(LOG_ERR, "Error trimming checkpoint %s", path);
+    free(records);
+    free(crcs);
+    return -1;
+  }
+
+  free(fwl->records);
+  free(fwl->record_crcs);
+  fwl->records = records;
+  fwl->record_crcs = crcs;
+  fwl->record_count = kept;
+  fwl->record_cap = kept;
+  fwl->record_end = end;
+  fwl->checkpointed = kept;
+  return end;
+}
+
+/**
+ * frame_scan reads the frames of a log file in RECOVER_CHUNK pieces, `buf`
+ * holds `filled` bytes of the file and the next frame is at `at` in it, or
+ * at `pos` in the file
+ */
+struct frame_scan {
+  int fd;
+  off_t size;
+  off_t pos;
+  char *buf;
+  size_t cap;
+  size_t filled;
+  size_t at;
 };
 
-struct file_with_lock *fwl;
+/**
+ * frame_scan_fill makes sure the `want` file bytes at `s->pos` are in
+ * `s->buf`, moving them to its start and reading more behind them if not
+ *
+ * Returns 1 if they are, 0 if the file ends first, -1 on error
+ */
+int frame_scan_fill(struct frame_scan *s, size_t want) {
+  if (s->filled - s->at >= want) {
+    return 1;
+  }
+  if (want > (uint64_t)(s->size - s->pos)) {
+    return 0;
+  }
+  memmove(s->buf, s->buf + s->at, s->filled - s->at);
+  s->filled -= s->at;
+  s->at = 0;
+  if (want > s->cap) {
+    char *buf = realloc(s->buf, want);
+    if (buf == NULL) {
+      return -1;
+    }
+    s->buf = buf;
+    s->cap = want;
+  }
+  size_t len = s->cap - s->filled;
+  if (len > (uint64_t)(s->size - s->pos) - s->filled) {
+    len = (s->size - s->pos) - s->filled;
+  }
+  if (pread_full(s->fd, s->buf + s->filled, len, s->pos + s->filled) == -1) {
+    return -1;
+  }
+  s->filled += len;
+  return 1;
+}
+
+/**
+ * file_with_lock_scan_frames indexes the frames of a framed log file of
+ * `size` bytes that follow the records already indexed
+ *
+ * The scan stops at the first frame that is cut off by the end of the file,
+ * fails its CRC32C or does not hold exactly one record, recovery then cuts
+ * the file there.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int file_with_lock_scan_frames(struct file_with_lock *fwl, off_t size) {
+  struct frame_scan s = {
+      .fd = fileno(fwl->file),
+      .size = size,
+      .pos = log_file_offset(fwl->record_end, fwl->record_count),
+      .buf = malloc(RECOVER_CHUNK),
+      .cap = RECOVER_CHUNK,
+  };
+  if (s.buf == NULL) {
+    return -1;
+  }
+  int ret;
+  while ((ret = frame_scan_fill(&s, LOG_FRAME_HDR)) == 1) {
+    uint32_t hdr[2];
+    memcpy(hdr, s.buf + s.at, sizeof hdr);
+    if (hdr[0] == 0 ||
+        (ret = frame_scan_fill(&s, LOG_FRAME_HDR + hdr[0])) != 1) {
+      break;
+    }
+    const char *rec = s.buf + s.at + LOG_FRAME_HDR;
+    if (aesd_crc32c(0, rec, hdr[0]) != hdr[1] ||
+        memchr(rec, '\n', hdr[0]) != rec + hdr[0] - 1) {
+      break;
+    }
+    if (file_with_lock_add_record(fwl, fwl->record_end + hdr[0], hdr[1]) ==
+        -1) {
+      ret = -1;
+      break;
+    }
+    s.at += LOG_FRAME_HDR + hdr[0];
+    s.pos += LOG_FRAME_HDR + hdr[0];
+  }
+  free(s.buf);
+  return (ret == -1) ? -1 : 0;
+}
+
+/**
+ * file_with_lock_scan_records indexes the records of a plain log file of
+ * `size` bytes from `offset` on
+ *
+ * Returns 0 on success, -1 on error
+ */
+int file_with_lock_scan_records(struct file_with_lock *fwl, off_t offset,
+                                off_t size) {
+  char *chunk = malloc(RECOVER_CHUNK);
+  if (chunk == NULL) {
+    return -1;
+  }
+  while (offset < size) {
+    size_t len = size - offset;
+    if (len > RECOVER_CHUNK) {
+      len = RECOVER_CHUNK;
+    }
+    if (pread_full(fileno(fwl->file), chunk, len, offset) == -1 ||
+        file_with_lock_index(fwl, chunk, len, offset) == -1) {
+      free(chunk);
+      return -1;
+    }
+    offset += len;
+  }
+  free(chunk);
+  return 0;
+}
+
+/**
+ * file_with_lock_check_format writes LOG_FRAME_MAGIC to a new framed log
+ * file and makes sure a kept one is framed exactly when -C is given
+ *
+ * Returns 0 on success, -1 on error or a mismatch
+ */
+int file_with_lock_check_format(struct file_with_lock *fwl) {
+  int fd = fileno(fwl->file);
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return -1;
+  }
+  if (st.st_size == 0) {
+    return framed ? pwrite_full(fd, LOG_FRAME_MAGIC, LOG_FRAME_MAGIC_LEN, 0)
+                  : 0;
+  }
+  char magic[LOG_FRAME_MAGIC_LEN];
+  bool has_magic = st.st_size >= LOG_FRAME_MAGIC_LEN &&
+                   pread_full(fd, magic, sizeof magic, 0) == 0 &&
+                   memcmp(magic, LOG_FRAME_MAGIC, sizeof magic) == 0;
+  if (has_magic != framed) {
+    syslog(LOG_ERR,
+           has_magic ? "%s holds framed records, it can only be kept with -C"
+                     : "%s holds plain records, it cannot be kept with -C",
+           fwl->path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * file_with_lock_recover rebuilds the state of a log file kept from a
+ * previous run: the index comes from the checkpoint and only the part of the
+ * file written after it is scanned for records
+ *
+ * Returns 0 on success, -1 on error
+ */
+int file_with_lock_recover(struct file_with_lock *fwl) {
+  struct stat st;
+  if (fstat(fileno(fwl->file), &st) == -1) {
+    return -1;
+  }
+  off_t offset = file_with_lock_load_checkpoint(fwl, st.st_size);
+  if (offset == -1) {
+    return -1;
+  }
+  off_t indexed = log_file_offset(offset, fwl->record_count);
+
+  if ((framed ? file_with_lock_scan_frames(fwl, st.st_size)
+              : file_with_lock_scan_records(fwl, offset, st.st_size)) == -1) {
+    return -1;
+  }
+
+  // a record cut off by a crash is dropped, the next append would otherwise
+  // be glued onto it and indexed as one corrupted record
+  off_t valid = log_file_offset(fwl->record_end, fwl->record_count);
+  if (valid < st.st_size) {
+    if (ftruncate(fileno(fwl->file), valid) == -1) {
+      return -1;
+    }
+    syslog(LOG_INFO, "Dropped %lld bytes of %s at the end of %s",
+           (long long)(st.st_size - valid),
+           framed ? "bad or torn frames" : "a partial record", fwl->path);
+  }
+  fwl->record_crc = 0;
+  fwl->size = fwl->record_end;
+  fwl->committed = fwl->record_end;
+  syslog(LOG_INFO,
+         "Recovered %s: %lld bytes, %zu records, %lld bytes scanned past "
+         "the checkpoint",
+         fwl->path, (long long)fwl->size, fwl->record_count,
+         (long long)(st.st_size - indexed));
+  return 0;
+}
+
+// end persistence
+
+void file_with_lock_free(struct file_with_lock *fwl) {
+  if (persistent && fwl->file != NULL) {
+    file_with_lock_checkpoint(fwl);
+  }
+  if (fwl->ckpt_fd != -1) {
+    close(fwl->ckpt_fd);
+  }
+  fair_lock_destroy(&fwl->file_mut);
+  pthread_cond_destroy(&fwl->grow_cond);
+  pthread_mutex_destroy(&fwl->grow_mut);
+  if (NULL != fwl->file) {
+    fclose(fwl->file);
+#if !USE_AESD_CHAR_DEVICE
+    // if the character device is being used, the device file should not be
+    // deleted
+    // otherwise, delete the temporary file unless it is kept across restarts
+    if (!persistent) {
+      remove(fwl->path);
+    }
+#endif
+  }
+  for (size_t i = 0; i < fwl->block_count; i++) {
+    free(fwl->blocks[i].frame);
+  }
+  free(fwl->blocks);
+  free(fwl->records);
+  free(fwl->record_crcs);
+  free(fwl->pending);
+  free(fwl);
+}
+
+/**
+ * file_with_lock_new allocates a log and, when using the file backend,
+ * creates an empty log file at `path`
+ *
+ * Returns the new log, or NULL on error
+ */
+struct file_with_lock *file_with_lock_new(const char *path) {
+  struct file_with_lock *fwl = calloc(1, sizeof(struct file_with_lock));
+  if (fwl == NULL) {
+    return NULL;
+  }
+  fwl->file = NULL;
+  fwl->ckpt_fd = -1;
+  snprintf(fwl->path, sizeof fwl->path, "%s", path);
+  if (fair_lock_init(&fwl->file_mut) != 0) {
+    syslog(LOG_ERR, "Error initializing mutex");
+    free(fwl);
+    return NULL;
+  }
+  pthread_mutex_init(&fwl->grow_mut, NULL);
+  pthread_cond_init(&fwl->grow_cond, NULL);
+
+  // check if the file already exists (bad exit could cause this)
+  // and delete it before creating a new one, unless it is being kept
+#if !USE_AESD_CHAR_DEVICE
+  FILE *aesd_exists = fopen(path, "r");
+  if (aesd_exists != NULL) {
+    fclose(aesd_exists);
+    if (!persistent) {
+      remove(path);
+    }
+  }
+
+  // create file to read/write to
+  fwl->file = fopen(path, "a+");
+  if (fwl->file == NULL) {
+    syslog(LOG_ERR, "Error on opening aesdfile %s", path);
+    fair_lock_destroy(&fwl->file_mut);
+    pthread_cond_destroy(&fwl->grow_cond);
+    pthread_mutex_destroy(&fwl->grow_mut);
+    free(fwl);
+    return NULL;
+  }
+  if (file_with_lock_check_format(fwl) == -1 ||
+      (persistent && file_with_lock_recover(fwl) == -1)) {
+    syslog(LOG_ERR, "Error recovering %s", path);
+    // the half built index must not be checkpointed over the good one
+    fclose(fwl->file);
+    fwl->file = NULL;
+    file_with_lock_free(fwl);
+    return NULL;
+  }
+#endif
+  return fwl;
+}
+
+// start channels
+
+#define CHANNEL_CMD "CHANNEL:"
+#define CHANNEL_CMD_LEN strlen(CHANNEL_CMD)
+#define CHANNEL_NAME_MAX 32
+#define CHANNEL_BUCKETS 64
+
+/**
+ * channel is a named log with its own file, lock and replay cache, selected
+ * by a client with "CHANNEL:<name>"
+ */
+struct channel {
+  char name[CHANNEL_NAME_MAX + 1];
+  struct file_with_lock *fwl;
+  struct channel *next;
+};
+
+struct channel_bucket {
+  pthread_rwlock_t lock;
+  struct channel *head;
+};
+
+/**
+ * channel_map is a fixed size hash map of channels with one rwlock per
+ * bucket, lookups of existing channels only take a read lock and channels in
+ * different buckets never contend
+ *
+ * Channels are created on first use and live until shutdown, so a
+ * `file_with_lock` returned by channel_lookup stays valid without holding the
+ * bucket lock.
+ */
+struct channel_map {
+  struct channel_bucket buckets[CHANNEL_BUCKETS];
+};
+
+struct channel_map channels;
+
+void channel_map_init(struct channel_map *map) {
+  for (int i = 0; i < CHANNEL_BUCKETS; i++) {
+    pthread_rwlock_init(&map->buckets[i].lock, NULL);
+    map->buckets[i].head = NULL;
+  }
+}
+
+void channel_map_destroy(struct channel_map *map) {
+  for (int i = 0; i < CHANNEL_BUCKETS; i++) {
+    struct channel *ch = map->buckets[i].head;
+    while (ch != NULL) {
+      struct channel *temp = ch->next;
+      file_with_lock_free(ch->fwl);
+      free(ch);
+      ch = temp;
+    }
+    map->buckets[i].head = NULL;
+    pthread_rwlock_destroy(&map->buckets[i].lock);
+  }
+}
+
+/**
+ * channel_name_valid only allows names that are safe to use in a file name
+ */
+bool channel_name_valid(const char *name, size_t len) {
+  if (len == 0 || len > CHANNEL_NAME_MAX) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    char c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '_' || c == '-')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t channel_hash(const char *name, size_t len) {
+  // FNV-1a
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+struct channel *channel_find(struct channel_bucket *bucket, const char *name,
+                             size_t len) {
+  for (struct channel *ch = bucket->head; ch != NULL; ch = ch->next) {
+    if (strlen(ch->name) == len && strncmp(ch->name, name, len) == 0) {
+      return ch;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * channel_lookup returns the log of channel `name`, creating the channel and
+ * its file (<log path>.<name>) if this is the first time it is used
+ *
+ * Returns NULL if the channel could not be created
+ */
+struct file_with_lock *channel_lookup(struct channel_map *map, const char *name,
+                                      size_t len) {
+  struct channel_bucket *bucket =
+      &map->buckets[channel_hash(name, len) % CHANNEL_BUCKETS];
+
+  pthread_rwlock_rdlock(&bucket->lock);
+  struct channel *ch = channel_find(bucket, name, len);
+  pthread_rwlock_unlock(&bucket->lock);
+  if (ch != NULL) {
+    return ch->fwl;
+  }
+
+  pthread_rwlock_wrlock(&bucket->lock);
+  // another connection may have created it between the two locks
+  ch = channel_find(bucket, name, len);
+  if (ch == NULL) {
+    ch = calloc(1, sizeof(struct channel));
+    if (ch != NULL) {
+      memcpy(ch->name, name, len);
+      char path[PATH_MAX];
+      snprintf(path, sizeof path, "%s.%s", log_path, ch->name);
+      ch->fwl = file_with_lock_new(path);
+      if (ch->fwl == NULL) {
+        free(ch);
+        ch = NULL;
+      } else {
+        ch->next = bucket->head;
+        bucket->head = ch;
+        syslog(LOG_INFO, "Created channel %s", ch->name);
+      }
+    }
+  }
+  pthread_rwlock_unlock(&bucket->lock);
+  return ch != NULL ? ch->fwl : NULL;
+}
+
+// end channels
+
+struct client_node {
+  int clientfd;
+  struct sockaddr_storage inc_addr;
+  socklen_t inc_addr_size;
+  char ipstr[INET6_ADDRSTRLEN];
+  // slot and generation of the connection table entry that owns this node,
+  // handed back to the accept loop when the connection thread finishes
+  uint32_t slot;
+  uint32_t generation;
+  // cpu the connection thread is pinned to (-1 when affinity is off) and the
+  // numa node its buffer was placed on
+  int cpu;
+  int numa_node;
+  // set by the AESD_COMPRESS command, replays are then sent as lz4 frames
+  // built in `zbuf`, which stays with the pooled node once allocated
+  bool compress;
+  struct replay_scratch *zbuf;
+  // log of the channel selected by the client, the default log until a
+  // CHANNEL command is received
+  struct file_with_lock *fwl;
+  // admission control state shared by all connections from the same address,
+  // local (AF_UNIX) clients all count as one address
+  struct client_limit *limit;
+  // descriptor received with SCM_RIGHTS on a local connection, waiting for
+  // the AESD_MEMFD command that uses it, -1 if none
+  int passed_fd;
+
+  // link used while the node sits in the pool free list
+  struct client_node *pool_next;
+  // receive/replay buffer, allocated in the same block as the node
+  size_t buf_size;
+  char buffer[];
+};
+
+// start cpu affinity
+
+#define AFF_MAX_NODES 16
+
+/**
+ * affinity holds the `-c` cpu list that aesdsocket threads are pinned to
+ *
+ * The accept loop and timestamp thread may run on any listed cpu, connection
+ * threads are each pinned to a single one (round robin, or the cpu that
+ * received the connection when `steer_incoming` is set). `cpu_node` caches
+ * the numa node of every listed cpu so buffers can be placed next to it.
+ */
+struct affinity {
+  bool enabled;
+  bool steer_incoming;
+  cpu_set_t cpus;
+  int cpu_list[CPU_SETSIZE];
+  size_t cpu_count;
+  size_t next;
+  int cpu_node[CPU_SETSIZE];
+};
+
+struct affinity aff;
+
+/**
+ * cpu_to_node looks up the numa node of `cpu` through sysfs
+ *
+ * Returns the node number, or 0 when it cannot be determined (no numa)
+ */
+int cpu_to_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return 0;
+  }
+  int node = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (sscanf(ent->d_name, "node%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+  if (node < 0 || node >= AFF_MAX_NODES) {
+    return 0;
+  }
+  return node;
+}
+
+/**
+ * affinity_parse parses a cpu list such as "0-3,8,10-11" into `aff`
+ *
+ * Returns 0 on success, -1 if the list is malformed or empty
+ */
+int affinity_parse(struct affinity *aff, const char *list) {
+  CPU_ZERO(&aff->cpus);
+  aff->cpu_count = 0;
+  const char *p = list;
+  while (*p != '\0') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p) {
+      return -1;
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+      p = end;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      if (!CPU_ISSET(cpu, &aff->cpus)) {
+        CPU_SET(cpu, &aff->cpus);
+        aff->cpu_list[aff->cpu_count++] = cpu;
+        aff->cpu_node[cpu] = cpu_to_node(cpu);
+      }
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return -1;
+    }
+  }
+  if (aff->cpu_count == 0) {
+    return -1;
+  }
+  aff->enabled = true;
+  return 0;
+}
+
+/**
+ * affinity_pick_cpu chooses the cpu the thread for `clientfd` is pinned to
+ *
+ * With `steer_incoming` the cpu that processed the connection's packets
+ * (SO_INCOMING_CPU) is used when it is part of the list, so the thread runs
+ * where the rx queue delivers its data. Otherwise cpus are handed out round
+ * robin.
+ *
+ * Returns the cpu, or -1 when affinity is disabled
+ */
+int affinity_pick_cpu(struct affinity *aff, int clientfd) {
+  if (!aff->enabled) {
+    return -1;
+  }
+  if (aff->steer_incoming) {
+    int cpu;
+    socklen_t len = sizeof cpu;
+    if (getsockopt(clientfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &aff->cpus)) {
+      return cpu;
+    }
+  }
+  int cpu = aff->cpu_list[aff->next];
+  aff->next = (aff->next + 1) % aff->cpu_count;
+  return cpu;
+}
+
+int affinity_cpu_node(struct affinity *aff, int cpu) {
+  return cpu < 0 ? 0 : aff->cpu_node[cpu];
+}
+
+// end cpu affinity
+
+// start admission control
+
+#define LIMIT_BUCKETS 256
+
+/**
+ * client_limit tracks one client address: its open connections and two
+ * token buckets, one in packets and one in bytes
+ *
+ * Buckets refill continuously at the configured rate and hold at most one
+ * second worth of tokens, so a client may burst up to its per second limit
+ * and is then paced down to the rate.
+ */
+struct client_limit {
+  uint8_t addr[16];
+  unsigned int connections;
+  double pkt_tokens;
+  double byte_tokens;
+  struct timespec refilled;
+  struct client_limit *next;
+};
+
+struct limit_bucket {
+  pthread_mutex_t mut;
+  struct client_limit *head;
+};
+
+/**
+ * client_limits maps client addresses to their `client_limit`, one mutex per
+ * hash bucket so unrelated clients do not contend
+ *
+ * A value of 0 for any of the limits means unlimited.
+ */
+struct client_limits {
+  struct limit_bucket buckets[LIMIT_BUCKETS];
+  unsigned int max_conns_per_ip;
+  double pkt_rate;
+  double byte_rate;
+
+  unsigned long conns_rejected;
+  unsigned long throttled;
+};
+
+struct client_limits limits;
+
+void client_limits_init(struct client_limits *lim) {
+  for (int i = 0; i < LIMIT_BUCKETS; i++) {
+    pthread_mutex_init(&lim->buckets[i].mut, NULL);
+    lim->buckets[i].head = NULL;
+  }
+}
+
+void client_limits_destroy(struct client_limits *lim) {
+  for (int i = 0; i < LIMIT_BUCKETS; i++) {
+    struct client_limit *cl = lim->buckets[i].head;
+    while (cl != NULL) {
+      struct client_limit *temp = cl->next;
+      free(cl);
+      cl = temp;
+    }
+    lim->buckets[i].head = NULL;
+    pthread_mutex_destroy(&lim->buckets[i].mut);
+  }
+}
+
+/**
+ * client_addr_key stores the address of `addr` as 16 bytes, ipv4 addresses
+ * are stored ipv4-mapped so both families share one key space
+ */
+void client_addr_key(const struct sockaddr_storage *addr, uint8_t key[16]) {
+  memset(key, 0, 16);
+  if (addr->ss_family == AF_INET6) {
+    memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+  } else if (addr->ss_family == AF_INET) {
+    key[10] = 0xff;
+    key[11] = 0xff;
+    memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+  }
+}
+
+struct limit_bucket *client_limit_bucket(struct client_limits *lim,
+                                         const uint8_t key[16]) {
+  uint32_t hash = 2166136261U;
+  for (int i = 0; i < 16; i++) {
+    hash ^= key[i];
+    hash *= 16777619U;
+  }
+  return &lim->buckets[hash % LIMIT_BUCKETS];
+}
+
+double timespec_diff(const struct timespec *later,
+                     const struct timespec *earlier) {
+  return (later->tv_sec - earlier->tv_sec) +
+         (later->tv_nsec - earlier->tv_nsec) / 1e9;
+}
+
+/**
+ * client_limit_refill adds the tokens earned since the last refill
+ *
+ * Must be called with the bucket mutex held.
+ */
+void client_limit_refill(struct client_limits *lim, struct client_limit *cl) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = timespec_diff(&now, &cl->refilled);
+  cl->refilled = now;
+  cl->pkt_tokens += elapsed * lim->pkt_rate;
+  if (cl->pkt_tokens > lim->pkt_rate) {
+    cl->pkt_tokens = lim->pkt_rate;
+  }
+  cl->byte_tokens += elapsed * lim->byte_rate;
+  if (cl->byte_tokens > lim->byte_rate) {
+    cl->byte_tokens = lim->byte_rate;
+  }
+}
+
+/**
+ * client_limit_idle tells whether `cl` can be dropped without losing any
+ * state: no open connection and both buckets full again
+ */
+bool client_limit_idle(struct client_limits *lim, struct client_limit *cl) {
+  return cl->connections == 0 && cl->pkt_tokens >= lim->pkt_rate &&
+         cl->byte_tokens >= lim->byte_rate;
+}
+
+/**
+ * client_limit_admit is called by the accept loop for every new connection
+ *
+ * Returns the `client_limit` the connection is charged to, or NULL if the
+ * address is already at its connection cap (or on allocation failure)
+ */
+struct client_limit *client_limit_admit(struct client_limits *lim,
+                                        const struct sockaddr_storage *addr) {
+  uint8_t key[16];
+  client_addr_key(addr, key);
+  struct limit_bucket *bucket = client_limit_bucket(lim, key);
+
+  pthread_mutex_lock(&bucket->mut);
+  struct client_limit *cl = NULL;
+  struct client_limit **link = &bucket->head;
+  while (*link != NULL) {
+    struct client_limit *cur = *link;
+    if (memcmp(cur->addr, key, 16) == 0) {
+      cl = cur;
+      link = &cur->next;
+      continue;
+    }
+    // drop idle entries on the way so the map only holds active clients
+    client_limit_refill(lim, cur);
+    if (client_limit_idle(lim, cur)) {
+      *link = cur->next;
+      free(cur);
+      continue;
+    }
+    link = &cur->next;
+  }
+
+  if (cl == NULL) {
+    cl = calloc(1, sizeof(struct client_limit));
+    if (cl == NULL) {
+      pthread_mutex_unlock(&bucket->mut);
+      return NULL;
+    }
+    memcpy(cl->addr, key, 16);
+    cl->pkt_tokens = lim->pkt_rate;
+    cl->byte_tokens = lim->byte_rate;
+    clock_gettime(CLOCK_MONOTONIC, &cl->refilled);
+    cl->next = bucket->head;
+    bucket->head = cl;
+  }
+
+  if (lim->max_conns_per_ip != 0 && cl->connections >= lim->max_conns_per_ip) {
+    lim->conns_rejected++;
+    pthread_mutex_unlock(&bucket->mut);
+    return NULL;
+  }
+  cl->connections++;
+  pthread_mutex_unlock(&bucket->mut);
+  return cl;
+}
+
+/**
+ * client_limit_release drops the connection count taken by
+ * client_limit_admit, the entry itself is freed lazily once idle
+ */
+void client_limit_release(struct client_limits *lim, struct client_limit *cl) {
+  struct limit_bucket *bucket = client_limit_bucket(lim, cl->addr);
+  pthread_mutex_lock(&bucket->mut);
+  cl->connections--;
+  pthread_mutex_unlock(&bucket->mut);
+}
+
+/**
+ * client_limit_throttle charges one packet of `bytes` to `cl`, sleeping
+ * until enough tokens are available
+ *
+ * The connection thread is not reading from its socket while it sleeps, so
+ * TCP flow control pushes the wait back to the sender instead of letting it
+ * queue up in the server. A single packet larger than the byte burst is let
+ * through once the bucket is full.
+ */
+void client_limit_throttle(struct client_limits *lim, struct client_limit *cl,
+                           size_t bytes) {
+  if (lim->pkt_rate == 0 && lim->byte_rate == 0) {
+    return;
+  }
+  struct limit_bucket *bucket = client_limit_bucket(lim, cl->addr);
+  bool counted = false;
+  for (;;) {
+    pthread_mutex_lock(&bucket->mut);
+    client_limit_refill(lim, cl);
+    double need_bytes = bytes < lim->byte_rate ? bytes : lim->byte_rate;
+    double wait = 0;
+    if (lim->pkt_rate != 0 && cl->pkt_tokens < 1) {
+      wait = (1 - cl->pkt_tokens) / lim->pkt_rate;
+    }
+    if (lim->byte_rate != 0 && cl->byte_tokens < need_bytes) {
+      double byte_wait = (need_bytes - cl->byte_tokens) / lim->byte_rate;
+      wait = byte_wait > wait ? byte_wait : wait;
+    }
+    if (wait == 0) {
+      if (lim->pkt_rate != 0) {
+        cl->pkt_tokens -= 1;
+      }
+      if (lim->byte_rate != 0) {
+        cl->byte_tokens -= need_bytes;
+      }
+      pthread_mutex_unlock(&bucket->mut);
+      return;
+    }
+    if (!counted) {
+      // bucket locks are per address, the counter is shared by all of them
+      __atomic_add_fetch(&lim->throttled, 1, __ATOMIC_RELAXED);
+      counted = true;
+    }
+    pthread_mutex_unlock(&bucket->mut);
+
+    struct timespec ts = {.tv_sec = (time_t)wait,
+                          .tv_nsec = (long)((wait - (time_t)wait) * 1e9)};
+    nanosleep(&ts, NULL);
+    if (shutdown_flag) {
+      return;
+    }
+  }
+}
+
+// end admission control
+
+// start connection object pool
+
+#define POOL_DEFAULT_SIZE 16
+
+/**
+ * conn_pool recycles `client_node` objects together with their I/O buffer
+ *
+ * Nodes are only taken and returned by the accept loop (on accept and when a
+ * finished connection is reaped), so the pool is owned by that one thread and
+ * needs no locking. Pooled nodes keep their pages resident, which avoids the
+ * malloc/free and page fault cost of a fresh 4K buffer per connection.
+ *
+ * There is one pool per numa node, nodes in a pool have their memory bound to
+ * that node so a connection pinned there works on local buffers.
+ */
+struct conn_pool {
+  struct client_node *free_list;
+  size_t free_count;
+  // upper bound on idle nodes kept around, extra nodes go back to malloc
+  size_t max_free;
+  size_t buf_size;
+  int numa_node;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long releases;
+};
+
+size_t pool_max_free = POOL_DEFAULT_SIZE;
+size_t pool_buf_size = BUFSIZE;
+struct conn_pool conn_pools[AFF_MAX_NODES];
+
+/**
+ * conn_pool_bind_node asks the kernel to back `addr` with memory from `node`
+ *
+ * Failure is not an error, the memory is simply left wherever it lands (for
+ * example on kernels without numa support).
+ */
+void conn_pool_bind_node(void *addr, size_t len, int node) {
+  unsigned long nodemask = 1UL << node;
+  if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &nodemask,
+              sizeof(nodemask) * 8, MPOL_MF_MOVE) == -1) {
+    syslog(LOG_DEBUG, "mbind to node %d failed: %s", node, strerror(errno));
+  }
+}
+
+struct client_node *conn_pool_alloc_node(struct conn_pool *pool) {
+  size_t size = sizeof(struct client_node) + pool->buf_size;
+  struct client_node *c_node;
+  if (aff.enabled) {
+    // page aligned so the whole object can be bound to the pool's node
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) & ~(page - 1);
+    if (posix_memalign((void **)&c_node, page, size) != 0) {
+      return NULL;
+    }
+    conn_pool_bind_node(c_node, size, pool->numa_node);
+  } else {
+    c_node = malloc(size);
+    if (c_node == NULL) {
+      return NULL;
+    }
+  }
+  c_node->buf_size = pool->buf_size;
+  c_node->numa_node = pool->numa_node;
+  c_node->zbuf = NULL;
+  // touch the buffer now so its pages are faulted in once, not per use
+  memset(c_node->buffer, 0, c_node->buf_size);
+  return c_node;
+}
+
+/**
+ * conn_pool_init sets up the pool for `numa_node` and fills it with
+ * `pool_max_free` ready-to-use nodes
+ *
+ * Returns 0 on success, -1 on error
+ */
+int conn_pool_init(struct conn_pool *pool, int numa_node) {
+  pool->max_free = pool_max_free;
+  pool->buf_size = pool_buf_size;
+  pool->numa_node = numa_node;
+  for (size_t i = 0; i < pool->max_free; i++) {
+    struct client_node *c_node = conn_pool_alloc_node(pool);
+    if (c_node == NULL) {
+      return -1;
+    }
+    c_node->pool_next = pool->free_list;
+    pool->free_list = c_node;
+    pool->free_count++;
+  }
+  return 0;
+}
+
+/**
+ * conn_pools_init sets up one pool for every numa node used by the `-c`
+ * cpu list, or only the node 0 pool when affinity is off
+ *
+ * Returns 0 on success, -1 on error
+ */
+int conn_pools_init(void) {
+  bool used[AFF_MAX_NODES] = {false};
+  used[0] = true;
+  for (size_t i = 0; i < aff.cpu_count; i++) {
+    used[aff.cpu_node[aff.cpu_list[i]]] = true;
+  }
+  for (int node = 0; node < AFF_MAX_NODES; node++) {
+    if (used[node] && conn_pool_init(&conn_pools[node], node) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void conn_pool_destroy(struct conn_pool *pool) {
+  while (pool->free_list != NULL) {
+    struct client_node *temp = pool->free_list;
+    pool->free_list = temp->pool_next;
+    free(temp->zbuf);
+    free(temp);
+  }
+  pool->free_count = 0;
+}
+
+void conn_pools_destroy(void) {
+  for (int node = 0; node < AFF_MAX_NODES; node++) {
+    conn_pool_destroy(&conn_pools[node]);
+  }
+}
+
+struct client_node *conn_pool_get(struct conn_pool *pool) {
+  if (pool->free_list != NULL) {
+    struct client_node *c_node = pool->free_list;
+    pool->free_list = c_node->pool_next;
+    pool->free_count--;
+    pool->hits++;
+    return c_node;
+  }
+  pool->misses++;
+  return conn_pool_alloc_node(pool);
+}
+
+void conn_pool_put(struct conn_pool *pool, struct client_node *c_node) {
+  pool->releases++;
+  if (pool->free_count >= pool->max_free) {
+    free(c_node->zbuf);
+    free(c_node);
+    return;
+  }
+  c_node->pool_next = pool->free_list;
+  pool->free_list = c_node;
+  pool->free_count++;
+}
+
+void conn_pool_log_stats(struct conn_pool *pool) {
+  unsigned long total = pool->hits + pool->misses;
+  if (pool->buf_size == 0) {
+    // pool for a node that is not in use
+    return;
+  }
+  syslog(LOG_INFO,
+         "conn pool node %d: %lu gets, %lu hits, %lu misses (%lu%% hit rate), "
+         "%zu idle of %zu, buffer %zu bytes",
+         pool->numa_node, total, pool->hits, pool->misses,
+         total ? (pool->hits * 100) / total : 0, pool->free_count,
+         pool->max_free, pool->buf_size);
+}
+
+// end connection object pool
+
+/**
+ * client_node_new takes in struct members, takes a `client_node` struct from
+ * the connection pool of the numa node of `cpu` and assigns the members.
+ *
+ * This function also calls `inet_ntop` to get the calling ip addr
+ */
+struct client_node *client_node_new(int clientfd,
+                                    struct sockaddr_storage inc_addr,
+                                    socklen_t inc_addr_size, int cpu) {
+  struct client_node *c_node =
+      conn_pool_get(&conn_pools[affinity_cpu_node(&aff, cpu)]);
+  if (c_node == NULL) {
+    return NULL;
+  }
+  c_node->clientfd = clientfd;
+  c_node->inc_addr = inc_addr;
+  c_node->inc_addr_size = inc_addr_size;
+  c_node->slot = 0;
+  c_node->generation = 0;
+  c_node->cpu = cpu;
+  c_node->compress = false;
+  c_node->fwl = fwl;
+  c_node->limit = NULL;
+  c_node->passed_fd = -1;
+  c_node->pool_next = NULL;
+  if (inc_addr.ss_family == AF_UNIX) {
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    if (getsockopt(clientfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+      snprintf(c_node->ipstr, sizeof c_node->ipstr, "local pid %d",
+               (int)cred.pid);
+    } else {
+      snprintf(c_node->ipstr, sizeof c_node->ipstr, "local");
+    }
+  } else if (inc_addr.ss_family == AF_INET6) {
+    struct sockaddr_in6 *s = (struct sockaddr_in6 *)&inc_addr;
+    inet_ntop(AF_INET6, &s->sin6_addr, c_node->ipstr, sizeof c_node->ipstr);
+  } else {
+    struct sockaddr_in *s = (struct sockaddr_in *)&inc_addr;
+    inet_ntop(AF_INET, &s->sin_addr, c_node->ipstr, sizeof c_node->ipstr);
+  }
+  syslog(LOG_INFO, "Accepted connection from %s", c_node->ipstr);
+
+  return c_node;
+}
+
+// end client thread and file
+
+// connection table
+
+#define CONN_TABLE_SIZE 1024
+#define CONN_SLOT_NONE (-1)
+
+struct conn_slot {
+  struct client_node *client_node;
+  pthread_t tid;
+  // bumped every time the slot is released, so a completion that refers to
+  // an older connection in the same slot can be told apart and ignored
+  uint32_t generation;
+  int next_free;
+  bool in_use;
+};
+
+struct conn_completion {
+  uint32_t slot;
+  uint32_t generation;
+};
+
+/**
+ * conn_table keeps every live connection in a fixed array of slots
+ *
+ * Free slots are chained through `next_free`, so taking and releasing a slot
+ * is O(1). Connection threads push their slot onto the `done` queue when they
+ * finish and bump `done_fd` (an eventfd), which wakes the accept loop so the
+ * thread is joined right away instead of on the next accept.
+ */
+struct conn_table {
+  struct conn_slot slots[CONN_TABLE_SIZE];
+  int free_head;
+  size_t active;
+
+  pthread_mutex_t done_mut;
+  // at most one completion per slot can be pending, so the queue never
+  // holds more than CONN_TABLE_SIZE entries
+  struct conn_completion done[CONN_TABLE_SIZE];
+  size_t done_head;
+  size_t done_count;
+  int done_fd;
+};
+
+struct conn_table conns = {.done_fd = -1};
+
+/**
+ * conn_table_init sets every slot as free and creates the completion eventfd
+ *
+ * Returns 0 on success, -1 on error
+ */
+int conn_table_init(struct conn_table *table) {
+  memset(table, 0, sizeof(struct conn_table));
+  for (int i = 0; i < CONN_TABLE_SIZE; i++) {
+    table->slots[i].next_free = (i + 1 < CONN_TABLE_SIZE) ? i + 1 : CONN_SLOT_NONE;
+  }
+  table->free_head = 0;
+
+  if (pthread_mutex_init(&table->done_mut, NULL) != 0) {
+    return -1;
+  }
+  table->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (table->done_fd == -1) {
+    pthread_mutex_destroy(&table->done_mut);
+    return -1;
+  }
+  return 0;
+}
+
+void conn_table_destroy(struct conn_table *table) {
+  close(table->done_fd);
+  pthread_mutex_destroy(&table->done_mut);
+}
+
+/**
+ * conn_table_alloc takes a slot off the free list and attaches `c_node` to it
+ *
+ * Returns the slot index, or CONN_SLOT_NONE when the table is full
+ */
+int conn_table_alloc(struct conn_table *table, struct client_node *c_node) {
+  int idx = table->free_head;
+  if (idx == CONN_SLOT_NONE) {
+    return CONN_SLOT_NONE;
+  }
+  struct conn_slot *slot = &table->slots[idx];
+  table->free_head = slot->next_free;
+  slot->next_free = CONN_SLOT_NONE;
+  slot->client_node = c_node;
+  slot->in_use = true;
+  table->active++;
+
+  c_node->slot = idx;
+  c_node->generation = slot->generation;
+  return idx;
+}
+
+/**
+ * conn_table_release closes the client socket, returns the client node to
+ * the pool and puts the slot back on the free list
+ *
+ * The thread owning the slot must already be joined (or never started)
+ */
+void conn_table_release(struct conn_table *table, int idx) {
+  struct conn_slot *slot = &table->slots[idx];
+  if (!slot->in_use) {
+    return;
+  }
+  close(slot->client_node->clientfd);
+  if (slot->client_node->limit != NULL) {
+    client_limit_release(&limits, slot->client_node->limit);
+  }
+  conn_pool_put(&conn_pools[slot->client_node->numa_node], slot->client_node);
+  slot->client_node = NULL;
+  slot->in_use = false;
+  slot->generation++;
+  slot->next_free = table->free_head;
+  table->free_head = idx;
+  table->active--;
+}
+
+/**
+ * conn_table_complete is called by a connection thread right before it exits
+ * to queue its slot for reaping and wake up the accept loop
+ */
+void conn_table_complete(struct conn_table *table, struct client_node *node) {
+  pthread_mutex_lock(&table->done_mut);
+  size_t tail = (table->done_head + table->done_count) % CONN_TABLE_SIZE;
+  table->done[tail].slot = node->slot;
+  table->done[tail].generation = node->generation;
+  table->done_count++;
+  pthread_mutex_unlock(&table->done_mut);
+
+  uint64_t one = 1;
+  if (write(table->done_fd, &one, sizeof one) != sizeof one) {
+    syslog(LOG_ERR, "Error signalling connection completion");
+  }
+}
+
+/**
+ * conn_table_reap joins and releases every connection that has signalled
+ * completion since the last call
+ */
+void conn_table_reap(struct conn_table *table) {
+  uint64_t pending;
+  // only used to clear the eventfd, the queue itself is the source of truth
+  if (read(table->done_fd, &pending, sizeof pending) == -1 && errno != EAGAIN) {
+    syslog(LOG_ERR, "Error reading connection completion eventfd");
+  }
+
+  for (;;) {
+    struct conn_completion done;
+    pthread_mutex_lock(&table->done_mut);
+    if (table->done_count == 0) {
+      pthread_mutex_unlock(&table->done_mut);
+      break;
+    }
+    done = table->done[table->done_head];
+    table->done_head = (table->done_head + 1) % CONN_TABLE_SIZE;
+    table->done_count--;
+    pthread_mutex_unlock(&table->done_mut);
+
+    struct conn_slot *slot = &table->slots[done.slot];
+    if (!slot->in_use || slot->generation != done.generation) {
+      // stale completion for a slot that has already been recycled
+      continue;
+    }
+    syslog(LOG_INFO, "Removing thread with id %lu", slot->tid);
+    pthread_join(slot->tid, NULL);
+    conn_table_release(table, done.slot);
+  }
+}
+
+// end connection table
+
+// start compressed replay
+
+#define AESD_COMPRESSCMD "AESD_COMPRESS:"
+#define AESD_COMPRESSCMD_LEN strlen(AESD_COMPRESSCMD)
+
+/**
+ * A compressed replay is a sequence of frames, each holding one block of at
+ * most REPLAY_BLOCK_SIZE log bytes:
+ *
+ *   uint32_t raw_len   (big endian)
+ *   uint32_t comp_len  (big endian, REPLAY_FRAME_STORED set if not compressed)
+ *   comp_len bytes of lz4 block data (or raw bytes when stored)
+ *
+ * A frame with both lengths 0 ends the replay.
+ */
+#define REPLAY_BLOCK_SIZE (64 * 1024)
+#define REPLAY_FRAME_HDR 8
+#define REPLAY_FRAME_STORED 0x80000000U
+#define REPLAY_FRAME_MAX                                                       \
+  (REPLAY_FRAME_HDR + AESD_LZ4_BOUND(REPLAY_BLOCK_SIZE))
+// compressed frames kept in the shared block cache, whatever lies beyond is
+// compressed again by every replay
+#define REPLAY_CACHE_MAX (64 * 1024 * 1024)
+
+struct replay_scratch {
+  uint8_t raw[REPLAY_BLOCK_SIZE];
+  size_t raw_len;
+  uint8_t frame[REPLAY_FRAME_MAX];
+};
+
+void put_be32(uint8_t *p, uint32_t val) {
+  p[0] = val >> 24;
+  p[1] = val >> 16;
+  p[2] = val >> 8;
+  p[3] = val;
+}
+
+/**
+ * send_all sends the whole of `buf`, retrying short sends
+ *
+ * Returns 0 on success, -1 on error
+ */
+int send_all(int fd, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t sent = send(fd, p, len, 0);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    AESD_TRACE2(send, fd, sent);
+    p += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+/**
+ * replay_build_frame compresses `len` (> 0) bytes of `raw` into a frame
+ * written to `frame`, which must hold REPLAY_FRAME_MAX bytes
+ *
+ * Blocks that do not shrink are stored as is.
+ *
+ * Returns the frame length
+ */
+size_t replay_build_frame(const uint8_t *raw, size_t len, uint8_t *frame) {
+  size_t comp = aesd_lz4_compress(raw, len, frame + REPLAY_FRAME_HDR,
+                                  REPLAY_FRAME_MAX - REPLAY_FRAME_HDR);
+  uint32_t comp_field = comp;
+  if (comp == 0 || comp >= len) {
+    memcpy(frame + REPLAY_FRAME_HDR, raw, len);
+    comp = len;
+    comp_field = len | REPLAY_FRAME_STORED;
+  }
+  put_be32(frame, len);
+  put_be32(frame + 4, comp_field);
+  return REPLAY_FRAME_HDR + comp;
+}
+
+int replay_send_end(struct client_node *node) {
+  uint8_t end[REPLAY_FRAME_HDR] = {0};
+  return send_all(node->clientfd, end, sizeof end);
+}
+
+/**
+ * replay_flush_scratch sends whatever is buffered in the node's scratch
+ * block as one frame
+ *
+ * Returns the number of bytes sent, -1 on error
+ */
+ssize_t replay_flush_scratch(struct client_node *node) {
+  struct replay_scratch *z = node->zbuf;
+  if (z->raw_len == 0) {
+    return 0;
+  }
+  size_t frame_len = replay_build_frame(z->raw, z->raw_len, z->frame);
+  z->raw_len = 0;
+  if (send_all(node->clientfd, z->frame, frame_len) == -1) {
+    return -1;
+  }
+  return frame_len;
+}
+
+/**
+ * replay_cached_block returns the cached frame for full block `idx` of the
+ * log, compressing it first if this is the first replay to reach it
+ *
+ * Blocks are cached in order, `idx` must not be past `fwl->block_count`.
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns the frame, or NULL on error
+ */
+struct replay_block *replay_cached_block(struct file_with_lock *fwl,
+                                         struct client_node *node, size_t idx) {
+  if (idx < fwl->block_count) {
+    fwl->blocks_reused++;
+    return &fwl->blocks[idx];
+  }
+
+  if (fwl->block_count == fwl->block_cap) {
+    size_t cap = fwl->block_cap ? fwl->block_cap * 2 : 16;
+    struct replay_block *blocks =
+        realloc(fwl->blocks, cap * sizeof(struct replay_block));
+    if (blocks == NULL) {
+      return NULL;
+    }
+    fwl->blocks = blocks;
+    fwl->block_cap = cap;
+  }
+
+  struct replay_scratch *z = node->zbuf;
+  if (log_pread(fwl, z->raw, REPLAY_BLOCK_SIZE,
+                (off_t)idx * REPLAY_BLOCK_SIZE) == -1) {
+    return NULL;
+  }
+  size_t frame_len = replay_build_frame(z->raw, REPLAY_BLOCK_SIZE, z->frame);
+  uint8_t *frame = malloc(frame_len);
+  if (frame == NULL) {
+    return NULL;
+  }
+  memcpy(frame, z->frame, frame_len);
+
+  struct replay_block *block = &fwl->blocks[fwl->block_count++];
+  block->frame = frame;
+  block->frame_len = frame_len;
+  fwl->block_bytes += frame_len;
+  fwl->blocks_compressed++;
+  return block;
+}
+
+/**
+ * replay_file_compressed sends the first `size` bytes of the log file as
+ * compressed frames, full blocks come from the shared cache and only the
+ * partial tail block is compressed for this replay
+ *
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns the number of bytes sent
+ */
+size_t replay_file_compressed(struct client_node *node,
+                              struct file_with_lock *fwl, off_t size) {
+  struct replay_scratch *z = node->zbuf;
+  size_t full = size / REPLAY_BLOCK_SIZE;
+  size_t sent = 0;
+
+  for (size_t i = 0; i < full; i++) {
+    if (i >= fwl->block_count && fwl->block_bytes >= REPLAY_CACHE_MAX) {
+      // the cache is full, this block is compressed for this replay only
+      z->raw_len = REPLAY_BLOCK_SIZE;
+      if (log_pread(fwl, z->raw, REPLAY_BLOCK_SIZE,
+                    (off_t)i * REPLAY_BLOCK_SIZE) == -1) {
+        syslog(LOG_ERR, "Error reading replay block %zu", i);
+        return sent;
+      }
+      ssize_t flushed = replay_flush_scratch(node);
+      if (flushed == -1) {
+        return sent;
+      }
+      sent += flushed;
+      continue;
+    }
+    struct replay_block *block = replay_cached_block(fwl, node, i);
+    if (block == NULL) {
+      syslog(LOG_ERR, "Error compressing replay block %zu", i);
+      return sent;
+    }
+    if (send_all(node->clientfd, block->frame, block->frame_len) == -1) {
+      return sent;
+    }
+    sent += block->frame_len;
+  }
+
+  z->raw_len = size - (off_t)full * REPLAY_BLOCK_SIZE;
+  if (z->raw_len > 0 &&
+      log_pread(fwl, z->raw, z->raw_len, (off_t)full * REPLAY_BLOCK_SIZE) ==
+          -1) {
+    syslog(LOG_ERR, "Error reading replay tail block");
+    return sent;
+  }
+  ssize_t flushed = replay_flush_scratch(node);
+  if (flushed == -1 || replay_send_end(node) == -1) {
+    return sent;
+  }
+  return sent + flushed + REPLAY_FRAME_HDR;
+}
+
+/**
+ * replay_fd_compressed sends everything that can be read from `fd` as
+ * compressed frames, used for the char device where contents are evicted
+ * and cannot be cached
+ *
+ * Returns the number of bytes sent
+ */
+size_t replay_fd_compressed(struct client_node *node, int fd) {
+  struct replay_scratch *z = node->zbuf;
+  ssize_t read_count;
+  ssize_t flushed;
+  size_t sent = 0;
+  z->raw_len = 0;
+  while ((read_count = read(fd, z->raw + z->raw_len,
+                            REPLAY_BLOCK_SIZE - z->raw_len)) > 0) {
+    z->raw_len += read_count;
+    if (z->raw_len == REPLAY_BLOCK_SIZE) {
+      if ((flushed = replay_flush_scratch(node)) == -1) {
+        return sent;
+      }
+      sent += flushed;
+    }
+  }
+  if ((flushed = replay_flush_scratch(node)) == -1 ||
+      replay_send_end(node) == -1) {
+    return sent;
+  }
+  return sent + flushed + REPLAY_FRAME_HDR;
+}
+
+/**
+ * handle_compress_cmd handles "AESD_COMPRESS:<codec>", `lz4` turns
+ * compressed replays on for the rest of the connection and `none` turns
+ * them back off
+ */
+void handle_compress_cmd(struct client_node *node, const char *cmd,
+                         size_t len) {
+  const char *codec = cmd + AESD_COMPRESSCMD_LEN;
+  size_t codec_len = len - AESD_COMPRESSCMD_LEN;
+  if (codec_len == 3 && strncmp(codec, "lz4", 3) == 0) {
+    if (node->zbuf == NULL) {
+      node->zbuf = malloc(sizeof(struct replay_scratch));
+      if (node->zbuf == NULL) {
+        syslog(LOG_ERR, "Error allocating compression buffers");
+        return;
+      }
+    }
+    node->compress = true;
+  } else if (codec_len == 4 && strncmp(codec, "none", 4) == 0) {
+    node->compress = false;
+  } else {
+    syslog(LOG_ERR, "Unknown replay codec %.*s", (int)codec_len, codec);
+  }
+}
+
+// end compressed replay
+
+/**
+ * replay_cork holds back partial frames while a replay is being written to
+ * `clientfd`, so chunks go out as full segments and are flushed at once when
+ * the cork is removed
+ *
+ * Errors are ignored, a socket that cannot be corked just sends as it goes.
+ */
+void replay_cork(int clientfd, bool on) {
+  int val = on;
+  setsockopt(clientfd, IPPROTO_TCP, TCP_CORK, &val, sizeof val);
+}
+
+// bytes asked of each sendfile call in replay_fd_plain
+#define REPLAY_SENDFILE_CHUNK (1 << 20)
+
+/**
+ * replay_fd_plain sends everything that can be read from `fd` to the client
+ *
+ * sendfile is tried first, a driver with splice support moves the data to the
+ * socket without the connection buffer. Otherwise reads are collected in the
+ * connection buffer until it is full, so each send covers a whole buffer no
+ * matter how little each read returns. Either way the replay stops at end of
+ * file or at the first error, which for a non blocking char device includes
+ * EAGAIN once everything stored has been read.
+ *
+ * Returns the number of bytes sent
+ */
+size_t replay_fd_plain(struct client_node *node, int fd) {
+  size_t fill = 0;
+  size_t sent = 0;
+  ssize_t read_count;
+
+  for (;;) {
+    read_count = sendfile(node->clientfd, fd, NULL, REPLAY_SENDFILE_CHUNK);
+    if (read_count == -1 && errno == EINTR) {
+      continue;
+    }
+    if (read_count <= 0) {
+      break;
+    }
+    AESD_TRACE2(send, node->clientfd, read_count);
+    sent += read_count;
+  }
+  // only a descriptor that cannot be spliced falls back to reads
+  if (sent > 0 || read_count == 0 || (errno != EINVAL && errno != ENOSYS)) {
+    return sent;
+  }
+
+  while ((read_count = read(fd, node->buffer + fill, node->buf_size - fill)) >
+         0) {
+    fill += read_count;
+    if (fill == node->buf_size) {
+      if (send_all(node->clientfd, node->buffer, fill) == -1) {
+        return sent;
+      }
+      sent += fill;
+      fill = 0;
+    }
+  }
+  if (fill > 0 && send_all(node->clientfd, node->buffer, fill) == 0) {
+    sent += fill;
+  }
+  return sent;
+}
+
+/**
+ * handle_channel_cmd handles "CHANNEL:<name>", switching the connection to
+ * the log of that channel
+ */
+void handle_channel_cmd(struct client_node *node, const char *cmd,
+                        size_t len) {
+  const char *name = cmd + CHANNEL_CMD_LEN;
+  size_t name_len = len - CHANNEL_CMD_LEN;
+#if USE_AESD_CHAR_DEVICE
+  syslog(LOG_ERR, "Channels need the file backend, ignoring %.*s",
+         (int)name_len, name);
+#else
+  if (!channel_name_valid(name, name_len)) {
+    syslog(LOG_ERR, "Invalid channel name %.*s", (int)name_len, name);
+    return;
+  }
+  struct file_with_lock *ch_fwl = channel_lookup(&channels, name, name_len);
+  if (ch_fwl == NULL) {
+    syslog(LOG_ERR, "Error creating channel %.*s", (int)name_len, name);
+    return;
+  }
+  node->fwl = ch_fwl;
+#endif
+}
+
+// start record queries
+
+#define AESD_RECORDCMD "AESD_RECORD:"
+#define AESD_RECORDCMD_LEN strlen(AESD_RECORDCMD)
+#define AESD_RECORDSCMD "AESD_RECORDS:"
+#define AESD_RECORDSCMD_LEN strlen(AESD_RECORDSCMD)
+#define AESD_RANGECMD "AESD_RANGE:"
+#define AESD_RANGECMD_LEN strlen(AESD_RANGECMD)
+
+/**
+ * parse_query_args parses "<a>" or "<a>,<b>" (as selected by `want`) from
+ * the `len` bytes at `args`
+ *
+ * Returns 0 on success, -1 if the arguments are malformed
+ */
+int parse_query_args(const char *args, size_t len, int want, long long *a,
+                     long long *b) {
+  char tmp[64];
+  if (len == 0 || len >= sizeof tmp) {
+    return -1;
+  }
+  memcpy(tmp, args, len);
+  tmp[len] = '\0';
+
+  char *end;
+  errno = 0;
+  *a = strtoll(tmp, &end, 10);
+  if (errno != 0 || end == tmp) {
+    return -1;
+  }
+  if (want == 1) {
+    return *end == '\0' ? 0 : -1;
+  }
+  if (*end != ',') {
+    return -1;
+  }
+  char *second = end + 1;
+  *b = strtoll(second, &end, 10);
+  if (errno != 0 || end == second || *end != '\0') {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * send_log_span sends `len` bytes of the log starting at `cur` with
+ * sendfile, straight from the page cache to the socket, or through the
+ * client buffer for a framed log, whose frame headers are left out
+ *
+ * Data below the committed size is never rewritten, so this does not need
+ * the log lock.
+ *
+ * Returns the number of bytes sent
+ */
+size_t send_log_span(struct client_node *node, struct file_with_lock *fwl,
+                     struct log_cursor *cur, size_t len) {
+  size_t sent = 0;
+  while (framed && sent < len) {
+    size_t chunk = len - sent;
+    if (chunk > node->buf_size) {
+      chunk = node->buf_size;
+    }
+    if (log_cursor_read(fwl, cur, node->buffer, chunk) == -1 ||
+        send_all(node->clientfd, node->buffer, chunk) == -1) {
+      break;
+    }
+    sent += chunk;
+  }
+  off_t offset = cur->pos;
+  while (!framed && sent < len) {
+    ssize_t ret = sendfile(node->clientfd, fileno(fwl->file), &offset,
+                           len - sent);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    AESD_TRACE2(send, node->clientfd, ret);
+    sent += ret;
+  }
+  return sent;
+}
+
+/**
+ * handle_query_cmd answers the random access commands of the file backend:
+ *
+ *   AESD_RECORD:<n>          record n
+ *   AESD_RECORDS:<n>,<m>     records n to m, inclusive
+ *   AESD_RANGE:<offset>,<len> len bytes starting at byte offset
+ *
+ * Record numbers start at 0 for the oldest record, negative numbers count
+ * back from the newest (-1 is the newest record). Ranges are clipped to the
+ * data available. None of these commands write to the log.
+ *
+ * The reply is "OK <bytes>\n" followed by that many bytes of the log, which
+ * may be 0 for an empty result, or "ERR\n" for a malformed query or when
+ * the char device backend is in use. A reply cut short after the header
+ * shuts the connection down.
+ *
+ * Returns true if `cmd` was one of these commands
+ */
+bool handle_query_cmd(struct client_node *node, const char *cmd, size_t len) {
+  long long a = 0;
+  long long b = 0;
+  int parsed;
+  enum { QUERY_RECORD, QUERY_RECORDS, QUERY_RANGE } kind;
+
+  if (strncmp(cmd, AESD_RECORDCMD, AESD_RECORDCMD_LEN) == 0) {
+    kind = QUERY_RECORD;
+    parsed = parse_query_args(cmd + AESD_RECORDCMD_LEN,
+                              len - AESD_RECORDCMD_LEN, 1, &a, &b);
+    b = a;
+  } else if (strncmp(cmd, AESD_RECORDSCMD, AESD_RECORDSCMD_LEN) == 0) {
+    kind = QUERY_RECORDS;
+    parsed = parse_query_args(cmd + AESD_RECORDSCMD_LEN,
+                              len - AESD_RECORDSCMD_LEN, 2, &a, &b);
+  } else if (strncmp(cmd, AESD_RANGECMD, AESD_RANGECMD_LEN) == 0) {
+    kind = QUERY_RANGE;
+    parsed = parse_query_args(cmd + AESD_RANGECMD_LEN, len - AESD_RANGECMD_LEN,
+                              2, &a, &b);
+  } else {
+    return false;
+  }
+
+  if (parsed == -1) {
+    syslog(LOG_ERR, "Malformed query %.*s", (int)len, cmd);
+    send_all(node->clientfd, "ERR\n", 4);
+    return true;
+  }
+
+#if USE_AESD_CHAR_DEVICE
+  syslog(LOG_ERR, "%s queries need the file backend, use %s instead",
+         kind == QUERY_RANGE ? "Range" : "Record", AESD_IOCTLSEEKTOCMD);
+  send_all(node->clientfd, "ERR\n", 4);
+#else
+  struct file_with_lock *log = node->fwl;
+  off_t start = 0;
+  size_t span = 0;
+  int found = 0;
+
+  fair_lock_acquire(&log->file_mut);
+  if (kind == QUERY_RANGE) {
+    if (a < 0 || b < 0 || a >= log->size) {
+      found = -1;
+    } else {
+      start = a;
+      span = (b > log->size - a) ? (size_t)(log->size - a) : (size_t)b;
+    }
+  } else {
+    found = file_with_lock_record_span(log, a, b, &start, &span);
+  }
+  struct log_cursor cur;
+  log_cursor_at(log, start, &cur);
+  fair_lock_release(&log->file_mut);
+
+  if (found == -1) {
+    span = 0;
+  }
+  char reply[32];
+  int reply_len = snprintf(reply, sizeof reply, "OK %zu\n", span);
+  AESD_TRACE3(replay_start, node->clientfd, log, span);
+  // the header and the data go out together
+  replay_cork(node->clientfd, true);
+  size_t sent = 0;
+  if (send_all(node->clientfd, reply, reply_len) == 0 && span > 0) {
+    sent = send_log_span(node, log, &cur, span);
+    if (sent < span) {
+      // the client expects span bytes after the header and can't tell the
+      // reply from what follows it, so the connection ends here
+      syslog(LOG_ERR, "Query reply to %s cut short after %zu of %zu bytes",
+             node->ipstr, sent, span);
+      shutdown(node->clientfd, SHUT_RDWR);
+    }
+  }
+  replay_cork(node->clientfd, false);
+  AESD_TRACE3(replay_end, node->clientfd, log, sent);
+#endif
+  return true;
+}
+
+// end record queries
+
+// start replication
+
+#define AESD_REPLICATECMD "AESD_REPLICATE:"
+#define AESD_REPLICATECMD_LEN strlen(AESD_REPLICATECMD)
+
+// frame header: offset (8), length (4), primary committed size (8), primary
+// send time in ns since the epoch (8) and CRC32C of the payload (4), all big
+// endian, followed by `length` bytes of the log, a frame with length 0 is a
+// heartbeat
+#define REPL_FRAME_HDR 32
+#define REPL_HEARTBEAT_MS 1000
+// a replica that hears nothing for this long reconnects
+#define REPL_TIMEOUT_S 5
+
+/**
+ * replica is the state of the replication client of a read only replica
+ */
+struct replica {
+  bool enabled;
+  char host[256];
+  char port[16];
+  pthread_t thread;
+
+  // guards everything below
+  pthread_mutex_t mut;
+  // socket to the primary, -1 while not connected
+  int fd;
+  off_t applied;
+  off_t primary_committed;
+  // delay of the last frame, from the primary sending it to it being applied
+  int64_t last_delay_ns;
+  struct timespec last_frame;
+  unsigned long reconnects;
+  unsigned long crc_errors;
+};
+
+struct replica repl = {.mut = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+void put_be64(uint8_t *p, uint64_t val) {
+  put_be32(p, val >> 32);
+  put_be32(p + 4, val);
+}
+
+uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+uint64_t get_be64(const uint8_t *p) {
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+int64_t timespec_ns(const struct timespec *ts) {
+  return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/**
+ * recv_full receives exactly `len` bytes, retrying short reads
+ *
+ * Returns 0 on success, -1 on error, timeout or end of stream
+ */
+int recv_full(int fd, void *buf, size_t len) {
+  uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t got = recv(fd, p, len, 0);
+    if (got == -1 && errno == EINTR && !shutdown_flag) {
+      continue;
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    p += got;
+    len -= got;
+  }
+  return 0;
+}
+
+/**
+ * replicate_send_frame sends one frame carrying the `len` bytes at `data`,
+ * read from the log at `offset`, or a heartbeat when `len` is 0
+ *
+ * Returns 0 on success, -1 if the replica went away
+ */
+int replicate_send_frame(struct client_node *node, const uint8_t *data,
+                         off_t offset, size_t len, off_t committed) {
+  uint8_t hdr[REPL_FRAME_HDR];
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  put_be64(hdr, offset);
+  put_be32(hdr + 8, len);
+  put_be64(hdr + 12, committed);
+  put_be64(hdr + 20, timespec_ns(&now));
+  put_be32(hdr + 28, aesd_crc32c(0, data, len));
+
+  replay_cork(node->clientfd, true);
+  int ret = send_all(node->clientfd, hdr, sizeof hdr);
+  if (ret == 0 && len > 0) {
+    ret = send_all(node->clientfd, data, len);
+  }
+  replay_cork(node->clientfd, false);
+  return ret;
+}
+
+/**
+ * replicate_to turns the connection into a replication stream of its log,
+ * starting at byte `offset`
+ *
+ * Only complete records are shipped. The payload is read into memory rather
+ * than sent with sendfile so its checksum is computed over the exact bytes
+ * that go out. Everything below `offset` is assumed to
+ * be on the replica already, so 0 sends a full snapshot and a reconnecting
+ * replica resumes from its own size. Returns when the replica disconnects or
+ * the server shuts down.
+ */
+void replicate_to(struct client_node *node, off_t offset) {
+  struct file_with_lock *log = node->fwl;
+
+  pthread_mutex_lock(&log->grow_mut);
+  off_t committed = log->committed;
+  pthread_mutex_unlock(&log->grow_mut);
+  if (offset < 0 || offset > committed) {
+    syslog(LOG_ERR, "Replica at offset %lld is ahead of %s (%lld bytes)",
+           (long long)offset, log->path, (long long)committed);
+    return;
+  }
+  uint8_t *data = malloc(REPLAY_BLOCK_SIZE);
+  if (data == NULL) {
+    syslog(LOG_ERR, "Error allocating the replication buffer");
+    return;
+  }
+  // the stream reads on from here without the log lock
+  struct log_cursor cur;
+  fair_lock_acquire(&log->file_mut);
+  log_cursor_at(log, offset, &cur);
+  fair_lock_release(&log->file_mut);
+  syslog(LOG_INFO, "Replicating %s to %s from offset %lld", log->path,
+         node->ipstr, (long long)offset);
+
+  while (!shutdown_flag) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPL_HEARTBEAT_MS / 1000;
+
+    pthread_mutex_lock(&log->grow_mut);
+    while (log->committed == offset && !shutdown_flag) {
+      if (pthread_cond_timedwait(&log->grow_cond, &log->grow_mut,
+                                 &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    committed = log->committed;
+    pthread_mutex_unlock(&log->grow_mut);
+
+    size_t len = committed - offset;
+    if (len > REPLAY_BLOCK_SIZE) {
+      len = REPLAY_BLOCK_SIZE;
+    }
+    if (len > 0 && log_cursor_read(log, &cur, data, len) == -1) {
+      syslog(LOG_ERR, "Error reading %s for replication", log->path);
+      break;
+    }
+    if (replicate_send_frame(node, data, offset, len, committed) == -1) {
+      break;
+    }
+    offset += len;
+  }
+  free(data);
+  syslog(LOG_INFO, "Stopped replicating to %s at offset %lld", node->ipstr,
+         (long long)offset);
+}
+
+/**
+ * handle_replicate_cmd parses "AESD_REPLICATE:<offset>" and streams the log
+ * of the connection from there until the replica goes away
+ */
+void handle_replicate_cmd(struct client_node *node, const char *cmd,
+                          size_t len) {
+  long long offset;
+  long long unused;
+  if (parse_query_args(cmd + AESD_REPLICATECMD_LEN,
+                       len - AESD_REPLICATECMD_LEN, 1, &offset,
+                       &unused) == -1) {
+    syslog(LOG_ERR, "Malformed replication request %.*s", (int)len, cmd);
+    return;
+  }
+#if USE_AESD_CHAR_DEVICE
+  syslog(LOG_ERR, "Replication needs the file backend");
+#else
+  replicate_to(node, offset);
+#endif
+}
+
+/**
+ * replica_parse splits the -P argument, "host:port" or "[v6addr]:port",
+ * into `r`
+ *
+ * Returns 0 on success, -1 if `arg` is malformed
+ */
+int replica_parse(struct replica *r, const char *arg) {
+  const char *colon = strrchr(arg, ':');
+  if (colon == NULL || colon == arg || colon[1] == '\0' ||
+      strlen(colon + 1) >= sizeof r->port) {
+    return -1;
+  }
+  const char *host = arg;
+  size_t host_len = colon - arg;
+  if (host[0] == '[' && host[host_len - 1] == ']') {
+    host++;
+    host_len -= 2;
+  }
+  if (host_len == 0 || host_len >= sizeof r->host) {
+    return -1;
+  }
+  memcpy(r->host, host, host_len);
+  r->host[host_len] = '\0';
+  strcpy(r->port, colon + 1);
+  r->enabled = true;
+  return 0;
+}
+
+/**
+ * replica_connect opens a connection to the primary
+ *
+ * Returns the socket, or -1 on error
+ */
+int replica_connect(struct replica *r) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM};
+  struct addrinfo *res;
+  if (getaddrinfo(r->host, r->port, &hints, &res) != 0) {
+    syslog(LOG_ERR, "Error resolving primary %s:%s", r->host, r->port);
+    return -1;
+  }
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd == -1) {
+    return -1;
+  }
+  // the primary sends a heartbeat every REPL_HEARTBEAT_MS, silence for longer
+  // than this means the connection is gone
+  struct timeval tv = {.tv_sec = REPL_TIMEOUT_S};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  return fd;
+}
+
+/**
+ * replica_follow requests the log from its current size and applies the
+ * frames the primary sends until the connection fails
+ */
+void replica_follow(struct replica *r, int fd, uint8_t *data) {
+  fair_lock_acquire(&fwl->file_mut);
+  // a framed log holds back the start of an unfinished record, it was
+  // applied all the same
+  off_t applied = fwl->size + fwl->pending_len;
+  fair_lock_release(&fwl->file_mut);
+
+  char cmd[64];
+  int cmd_len = snprintf(cmd, sizeof cmd, AESD_REPLICATECMD "%lld\n",
+                         (long long)applied);
+  if (send_all(fd, cmd, cmd_len) == -1) {
+    return;
+  }
+  syslog(LOG_INFO, "Following %s:%s from offset %lld", r->host, r->port,
+         (long long)applied);
+
+  uint8_t hdr[REPL_FRAME_HDR];
+  while (!shutdown_flag && recv_full(fd, hdr, sizeof hdr) == 0) {
+    off_t offset = get_be64(hdr);
+    size_t len = get_be32(hdr + 8);
+    off_t committed = get_be64(hdr + 12);
+    int64_t sent_ns = get_be64(hdr + 20);
+    uint32_t crc = get_be32(hdr + 28);
+    if (offset != applied || len > REPLAY_BLOCK_SIZE) {
+      syslog(LOG_ERR, "Bad replication frame at %lld (expected %lld)",
+             (long long)offset, (long long)applied);
+      return;
+    }
+    if (len > 0) {
+      if (recv_full(fd, data, len) == -1) {
+        return;
+      }
+      if (aesd_crc32c(0, data, len) != crc) {
+        syslog(LOG_ERR, "Replication frame at %lld failed its crc check",
+               (long long)offset);
+        pthread_mutex_lock(&r->mut);
+        r->crc_errors++;
+        pthread_mutex_unlock(&r->mut);
+        return;
+      }
+      fair_lock_acquire(&fwl->file_mut);
+      int ret = file_with_lock_append(fwl, (char *)data, len);
+      fair_lock_release(&fwl->file_mut);
+      if (ret == -1) {
+        syslog(LOG_ERR, "Error applying replicated data to %s", fwl->path);
+        return;
+      }
+      applied += len;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&r->mut);
+    r->applied = applied;
+    r->primary_committed = committed;
+    r->last_delay_ns = timespec_ns(&now) - sent_ns;
+    r->last_frame = now;
+    pthread_mutex_unlock(&r->mut);
+  }
+}
+
+/**
+ * replica_thread is a pthread function that keeps the local log following
+ * the primary, reconnecting every second while it is unreachable
+ */
+void *replica_thread(void *_r) {
+  struct replica *r = _r;
+  uint8_t *data = malloc(REPLAY_BLOCK_SIZE);
+  if (data == NULL) {
+    syslog(LOG_ERR, "Error allocating the replication buffer");
+    return NULL;
+  }
+
+  while (!shutdown_flag) {
+    int fd = replica_connect(r);
+    if (fd != -1) {
+      pthread_mutex_lock(&r->mut);
+      r->fd = fd;
+      pthread_mutex_unlock(&r->mut);
+      // replica_stop may have run between the connect and publishing fd
+      if (!shutdown_flag) {
+        replica_follow(r, fd, data);
+      }
+      pthread_mutex_lock(&r->mut);
+      r->fd = -1;
+      r->reconnects++;
+      pthread_mutex_unlock(&r->mut);
+      close(fd);
+    }
+    if (!shutdown_flag) {
+      sleep(1);
+    }
+  }
+  free(data);
+  return NULL;
+}
+
+/**
+ * replica_stop wakes the replication thread up and joins it, shutdown_flag
+ * must be raised already
+ */
+void replica_stop(struct replica *r) {
+  pthread_mutex_lock(&r->mut);
+  if (r->fd != -1) {
+    shutdown(r->fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&r->mut);
+  // interrupts a connect or sleep, the handler only raises shutdown_flag again
+  pthread_kill(r->thread, SIGTERM);
+  pthread_join(r->thread, NULL);
+}
+
+/**
+ * replica_log_stats writes the replication lag to syslog
+ *
+ * The byte lag is how far the local log trails the committed size last
+ * reported by the primary, the delay is how long the last frame took from
+ * the primary to the local log (it includes any clock difference between
+ * the hosts) and the age is the time since the primary was last heard from.
+ */
+void replica_log_stats(struct replica *r) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  pthread_mutex_lock(&r->mut);
+  long long age_ms =
+      r->last_frame.tv_sec == 0
+          ? -1
+          : (timespec_ns(&now) - timespec_ns(&r->last_frame)) / 1000000;
+  syslog(LOG_INFO,
+         "replica of %s:%s: %s, applied %lld, primary committed %lld, "
+         "lag %lld bytes, delay %lld us, last frame %lld ms ago, "
+         "%lu reconnects, %lu crc errors",
+         r->host, r->port, r->fd != -1 ? "connected" : "disconnected",
+         (long long)r->applied, (long long)r->primary_committed,
+         (long long)(r->primary_committed - r->applied),
+         (long long)(r->last_delay_ns / 1000), age_ms, r->reconnects,
+         r->crc_errors);
+  pthread_mutex_unlock(&r->mut);
+}
+
+// end replication
+
+// start local clients
+
+#define AESD_MEMFDCMD "AESD_MEMFD:"
+#define AESD_MEMFDCMD_LEN strlen(AESD_MEMFDCMD)
+// a submitted memfd must not be able to change while it is being appended
+#define MEMFD_REQUIRED_SEALS (F_SEAL_WRITE | F_SEAL_SHRINK)
+
+/**
+ * conn_recv receives from a client like recv(), on local connections it also
+ * picks up a descriptor passed with SCM_RIGHTS and keeps it in
+ * `node->passed_fd` for the next AESD_MEMFD command
+ */
+ssize_t conn_recv(struct client_node *node, char *buf, size_t len) {
+  if (node->inc_addr.ss_family != AF_UNIX) {
+    return recv(node->clientfd, buf, len, 0);
+  }
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl.buf,
+                       .msg_controllen = sizeof ctrl.buf};
+  // descriptors beyond the first do not fit in `ctrl` and are closed by the
+  // kernel
+  ssize_t ret = recvmsg(node->clientfd, &msg, MSG_CMSG_CLOEXEC);
+  if (ret <= 0) {
+    return ret;
+  }
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+      if (node->passed_fd != -1) {
+        close(node->passed_fd);
+      }
+      memcpy(&node->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  return ret;
+}
+
+/**
+ * log_copy_fd appends the first `len` bytes of `fd` to the log file without
+ * passing them through user space
+ *
+ * copy_file_range is tried first, sendfile is the fallback for kernels that
+ * refuse to copy between different file systems. Both need a descriptor
+ * without O_APPEND, so the log is opened once more for writing at its end.
+ * Must be called with `fwl->file_mut` held.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int log_copy_fd(struct file_with_lock *fwl, int fd, size_t len) {
+  int out = open(fwl->path, O_WRONLY | O_CLOEXEC);
+  if (out == -1) {
+    return -1;
+  }
+  off_t in_off = 0;
+  off_t out_off = fwl->size;
+  bool use_sendfile = false;
+  while ((size_t)in_off < len) {
+    ssize_t ret;
+    if (!use_sendfile) {
+      ret = copy_file_range(fd, &in_off, out, &out_off, len - in_off, 0);
+      if (ret == -1 && (errno == EXDEV || errno == EINVAL ||
+                        errno == ENOSYS || errno == EOPNOTSUPP)) {
+        use_sendfile = true;
+        if (lseek(out, out_off, SEEK_SET) == -1) {
+          break;
+        }
+        continue;
+      }
+    } else {
+      ret = sendfile(out, fd, &in_off, len - in_off);
+    }
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+  }
+  close(out);
+  return (size_t)in_off == len ? 0 : -1;
+}
+
+/**
+ * handle_memfd_cmd appends the sealed memfd passed with the AESD_MEMFD
+ * command to the log of the connection in one go
+ *
+ * The memfd must carry F_SEAL_WRITE and F_SEAL_SHRINK. Its contents are
+ * copied file to file in the kernel and indexed through a read only mapping.
+ * The reply is "OK <bytes>\n" or "ERR\n", never a replay.
+ */
+void handle_memfd_cmd(struct client_node *node) {
+  int fd = node->passed_fd;
+  node->passed_fd = -1;
+  bool ok = false;
 
-void file_with_lock_free(struct file_with_lock *fwl) {
-  pthread_mutex_destroy(&fwl->file_mut);
-  if (NULL != fwl->file) {
-    fclose(fwl->file);
+#if USE_AESD_CHAR_DEVICE
+  syslog(LOG_ERR, "Bulk submission needs the file backend");
+#else
+  struct file_with_lock *log = node->fwl;
+  struct stat st;
+  int seals;
+  if (fd == -1) {
+    syslog(LOG_ERR, "%s from %s without a descriptor", AESD_MEMFDCMD,
+           node->ipstr);
+  } else if (repl.enabled) {
+    syslog(LOG_DEBUG, "Read only replica, not appending from %s",
+           node->ipstr);
+  } else if ((seals = fcntl(fd, F_GET_SEALS)) == -1 ||
+             (seals & MEMFD_REQUIRED_SEALS) != MEMFD_REQUIRED_SEALS) {
+    syslog(LOG_ERR, "Rejecting unsealed memfd from %s", node->ipstr);
+  } else if (fstat(fd, &st) == -1) {
+    syslog(LOG_ERR, "Error reading the size of the memfd from %s",
+           node->ipstr);
+  } else {
+    size_t len = st.st_size;
+    void *map = NULL;
+    if (len > 0 &&
+        (map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      syslog(LOG_ERR, "Error mapping the memfd from %s", node->ipstr);
+    } else {
+      AESD_TRACE2(lock_acquire, log, node->clientfd);
+      fair_lock_acquire(&log->file_mut);
+      AESD_TRACE2(lock_acquired, log, node->clientfd);
+      off_t offset = log->size;
+      AESD_TRACE4(append, node->clientfd, log, offset, len);
+      if (len == 0) {
+        ok = true;
+      } else if (framed) {
+        // records are framed on the way in, the file cannot take a raw copy
+        ok = file_with_lock_append(log, map, len) == 0;
+        if (!ok) {
+          syslog(LOG_ERR, "Error appending the memfd from %s", node->ipstr);
+        }
+      } else if (log_copy_fd(log, fd, len) == 0) {
+        file_with_lock_appended(log, map, len, offset);
+        ok = true;
+      } else {
+        syslog(LOG_ERR, "Error appending the memfd from %s", node->ipstr);
+        // drop whatever part of the copy made it, so the file and the index
+        // still agree
+        if (ftruncate(fileno(log->file), offset) == -1) {
+          syslog(LOG_ERR, "Error truncating %s", log->path);
+        }
+      }
+      AESD_TRACE2(lock_release, log, node->clientfd);
+      fair_lock_release(&log->file_mut);
+      if (map != NULL) {
+        munmap(map, len);
+      }
+      if (ok) {
+        syslog(LOG_DEBUG, "Appended %zu bytes from a memfd of %s", len,
+               node->ipstr);
+      }
+    }
+  }
+  if (ok) {
+    char reply[32];
+    int reply_len =
+        snprintf(reply, sizeof reply, "OK %lld\n", (long long)st.st_size);
+    send_all(node->clientfd, reply, reply_len);
+  }
+#endif
+  if (!ok) {
+    send_all(node->clientfd, "ERR\n", 4);
+  }
+  if (fd != -1) {
+    close(fd);
   }
-  free(fwl);
 }
 
-struct client_node {
-  int clientfd;
-  struct sockaddr_storage inc_addr;
-  socklen_t inc_addr_size;
-  char ipstr[INET6_ADDRSTRLEN];
-  bool operation_complete;
-};
-
 /**
- * client_node_new takes in struct members, allocates space for a new
- * `client_node` struct and assigns the members.
+ * local_listen creates the AF_UNIX stream socket at `path`, replacing a
+ * stale one left by a previous run
  *
- * This function also calls `inet_ntop` to get the calling ip addr
+ * Returns the listening socket, or -1 on error
  */
-struct client_node *client_node_new(int clientfd,
-                                    struct sockaddr_storage inc_addr,
-                                    socklen_t inc_addr_size) {
-  struct client_node *c_node = malloc(sizeof(struct client_node));
-  if (c_node == NULL) {
-    return NULL;
+int local_listen(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof addr.sun_path) {
+    syslog(LOG_ERR, "Socket path %s is too long", path);
+    return -1;
   }
-  c_node->clientfd = clientfd;
-  c_node->inc_addr = inc_addr;
-  c_node->inc_addr_size = inc_addr_size;
-  c_node->operation_complete = false;
-  struct sockaddr_in *s = (struct sockaddr_in *)&inc_addr;
-  inet_ntop(AF_INET, &s->sin_addr, c_node->ipstr, sizeof c_node->ipstr);
-  syslog(LOG_INFO, "Accepted connection from %s", c_node->ipstr);
-
-  return c_node;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    syslog(LOG_ERR, "Error creating the local socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+      listen(fd, BACKLOG) == -1) {
+    syslog(LOG_ERR, "Error listening on %s", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
 }
 
-struct client_thread_node {
-  struct client_node *client_node;
-  pthread_t tid;
+// end local clients
 
-  struct client_thread_node *next;
-};
+// start udp ingest
 
-// end client thread and file
+// datagrams taken from the socket per recvmmsg call
+#define UDP_BATCH 64
+#define UDP_RCVBUF (4 * 1024 * 1024)
+
+/**
+ * udp_ingest is the optional fire and forget listener (-U), every datagram
+ * is one record and nothing is sent back
+ *
+ * The counters are written by the ingest thread and read for the stats.
+ */
+struct udp_ingest {
+  bool enabled;
+  const char *port;
+  int fd;
+  pthread_t thread;
+  unsigned long datagrams;
+  unsigned long batches;
+  unsigned long bytes;
+  // larger than the receive buffer (-b), dropped
+  unsigned long oversized;
+  // dropped by the kernel because the socket buffer was full, as reported
+  // by SO_RXQ_OVFL
+  uint32_t kernel_drops;
+};
 
-// linked list functions
+struct udp_ingest udp = {.fd = -1};
 
 /**
- * list_add_to_start takes a pointer to a new `struct client_thread_node`
- * pointer and adds it to the front of the list
+ * udp_listen binds the datagram socket for port `port`
+ *
+ * Returns the socket, or -1 on error
  */
-void list_add_to_start(struct client_thread_node **head,
-                       struct client_thread_node *new_node) {
-  // *head doesn't point to anything, set new_node as head
-  if (*head == NULL) {
-    *head = new_node;
-    (*head)->next = NULL;
-    return;
+int udp_listen(const char *port) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_DGRAM,
+                           .ai_flags = AI_PASSIVE};
+  struct addrinfo *res;
+  if (getaddrinfo(NULL, port, &hints, &res) != 0) {
+    syslog(LOG_ERR, "Error getting addrinfo for udp port %s", port);
+    return -1;
+  }
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  int yes = 1;
+  if (fd == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof yes) == -1 ||
+      bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+    syslog(LOG_ERR, "Error binding udp port %s", port);
+    if (fd != -1) {
+      close(fd);
+    }
+    freeaddrinfo(res);
+    return -1;
   }
-  new_node->next = *head;
-  *head = new_node;
+  freeaddrinfo(res);
+  // bursts queue up here while a batch waits for the log lock, the kernel
+  // caps this at net.core.rmem_max
+  int rcvbuf = UDP_RCVBUF;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  // bounds how long shutdown can go unnoticed if the wake up signal lands
+  // just before recvmmsg blocks
+  struct timeval tv = {.tv_sec = 1};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  return fd;
 }
 
+#if USE_AESD_CHAR_DEVICE
+// records handed to the driver by one AESDCHAR_IOCBATCH
+#define DEV_BATCH_RECORDS 128
+
 /**
- * list_remove_head takes in a `struct client_thread_node` double pointer
- * to remove the head from the list
+ * dev_append_records commits the newline terminated records in `data` to the
+ * char device `char_dev`, one entry each, with AESDCHAR_IOCBATCH so a batch
+ * of records costs a single syscall. A driver without the ioctl gets one
+ * write per record instead.
  *
- * This function also handles freeing the memory of the removed list entry
+ * Returns 0 on success, -1 on error
  */
-void list_remove_head(struct client_thread_node **head) {
-  if (*head == NULL) {
-    return;
+int dev_append_records(int char_dev, const char *data, size_t len) {
+  struct aesd_record records[DEV_BATCH_RECORDS];
+  const char *p = data;
+  const char *end = data + len;
+  while (p < end) {
+    uint32_t count = 0;
+    for (const char *q = p; q < end && count < DEV_BATCH_RECORDS; count++) {
+      const char *newline = memchr(q, '\n', end - q);
+      const char *stop = newline != NULL ? newline + 1 : end;
+      records[count] = (struct aesd_record){.buf = (uintptr_t)q,
+                                            .len = stop - q};
+      q = stop;
+    }
+    struct aesd_batch b = {.records = (uintptr_t)records, .count = count};
+    if (ioctl(char_dev, AESDCHAR_IOCBATCH, &b) == -1) {
+      if (errno == ENOTTY) {
+        break;
+      }
+      return -1;
+    }
+    if (b.accepted == 0) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < b.accepted; i++) {
+      p += records[i].len;
+    }
   }
 
-  struct client_thread_node *temp = *head;
-  *head = (*head)->next;
-  free(temp->client_node);
-  free(temp);
+  // the driver commits one entry per write, up to the first newline
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    size_t record_len = newline != NULL ? newline - p + 1 : end - p;
+    ssize_t written = write(char_dev, p, record_len);
+    if (written <= 0) {
+      return -1;
+    }
+    p += written;
+  }
+  return 0;
 }
+#endif
 
 /**
- * list_remove_using_client_file_node searches the linked list, starting from
- * the head node, looking for a list entry that has the same thread id as the
- * `cft` node
- *
- * This function handles freeing the memory of the removed list entry
+ * udp_append commits one batch (`len` bytes of newline terminated records)
+ * with a single append under the log lock
  */
-void list_remove_using_client_file_node(struct client_thread_node **head,
-                                        struct client_thread_node *cft) {
-  // empty list
-  if (*head == NULL) {
+void udp_append(const char *batch, size_t len) {
+  if (len == 0) {
     return;
   }
-
-  struct client_thread_node *temp = *head;
-  struct client_thread_node *prev = NULL;
-
-  if (temp != NULL && temp->tid == cft->tid) {
-    *head = temp->next;
-    free(temp->client_node);
-    free(temp);
-    return;
+  fair_lock_acquire(&fwl->file_mut);
+#if !USE_AESD_CHAR_DEVICE
+  AESD_TRACE4(append, udp.fd, fwl, fwl->size, len);
+  file_with_lock_append(fwl, batch, len);
+#else
+  AESD_TRACE4(append, udp.fd, fwl, -1, len);
+  int char_dev = open(log_path, O_RDWR);
+  if (char_dev != -1) {
+    if (dev_append_records(char_dev, batch, len) == -1) {
+      syslog(LOG_ERR, "Error appending udp records to %s", log_path);
+    }
+    close(char_dev);
   }
+#endif
+  fair_lock_release(&fwl->file_mut);
+}
 
-  while (temp != NULL && temp->tid != cft->tid) {
-    prev = temp;
-    temp = temp->next;
+/**
+ * handle_udp is a pthread function that receives datagrams in batches of up
+ * to UDP_BATCH and appends each batch to the default log in one go
+ *
+ * A datagram without a trailing newline gets one, so every datagram ends up
+ * as (at least) one complete record.
+ */
+void *handle_udp(void *_udp) {
+  struct udp_ingest *u = _udp;
+  size_t dgram_max = pool_buf_size;
+  char *bufs = malloc(UDP_BATCH * dgram_max);
+  // every datagram can grow by its newline
+  char *batch = malloc(UDP_BATCH * (dgram_max + 1));
+  if (bufs == NULL || batch == NULL) {
+    syslog(LOG_ERR, "Error allocating the udp buffers");
+    free(bufs);
+    free(batch);
+    return NULL;
   }
 
-  // value not found
-  if (temp == NULL) {
-    return;
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  union {
+    char buf[CMSG_SPACE(sizeof(uint32_t))];
+    struct cmsghdr align;
+  } ctrl[UDP_BATCH];
+
+  while (!shutdown_flag) {
+    for (int i = 0; i < UDP_BATCH; i++) {
+      iovs[i].iov_base = bufs + i * dgram_max;
+      iovs[i].iov_len = dgram_max;
+      memset(&msgs[i], 0, sizeof msgs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+      msgs[i].msg_hdr.msg_controllen = sizeof ctrl[i].buf;
+    }
+    // block for the first datagram, then take whatever else is queued
+    int count = recvmmsg(u->fd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+    if (count == -1) {
+      if (errno != EINTR && errno != EAGAIN) {
+        syslog(LOG_ERR, "Error receiving udp datagrams");
+      }
+      continue;
+    }
+
+    size_t len = 0;
+    unsigned long oversized = 0;
+    for (int i = 0; i < count; i++) {
+      struct msghdr *hdr = &msgs[i].msg_hdr;
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+          uint32_t drops;
+          memcpy(&drops, CMSG_DATA(cmsg), sizeof drops);
+          __atomic_store_n(&u->kernel_drops, drops, __ATOMIC_RELAXED);
+        }
+      }
+      if (hdr->msg_flags & MSG_TRUNC) {
+        oversized++;
+        continue;
+      }
+      size_t dgram_len = msgs[i].msg_len;
+      if (dgram_len == 0) {
+        continue;
+      }
+      memcpy(batch + len, iovs[i].iov_base, dgram_len);
+      len += dgram_len;
+      if (batch[len - 1] != '\n') {
+        batch[len++] = '\n';
+      }
+    }
+    AESD_TRACE2(recv, u->fd, len);
+    udp_append(batch, len);
+
+    __atomic_add_fetch(&u->datagrams, count - oversized, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&u->oversized, oversized, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&u->bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&u->batches, 1, __ATOMIC_RELAXED);
   }
+  free(bufs);
+  free(batch);
+  return NULL;
+}
 
-  // found the same thread id, time remove that from the list
-  prev->next = temp->next;
-  free(temp->client_node);
-  free(temp);
+void udp_log_stats(struct udp_ingest *u) {
+  syslog(LOG_INFO,
+         "udp: %lu datagrams in %lu batches, %lu bytes, %lu oversized, "
+         "%u dropped by the kernel",
+         __atomic_load_n(&u->datagrams, __ATOMIC_RELAXED),
+         __atomic_load_n(&u->batches, __ATOMIC_RELAXED),
+         __atomic_load_n(&u->bytes, __ATOMIC_RELAXED),
+         __atomic_load_n(&u->oversized, __ATOMIC_RELAXED),
+         __atomic_load_n(&u->kernel_drops, __ATOMIC_RELAXED));
 }
 
-// end linked list functions
+// end udp ingest
 
 /**
  * handle_connection is a pthread function meant to handle the client connection
@@ -182,43 +3474,108 @@ void *handle_connection(void *_node) {
   struct client_node *node = (struct client_node *)_node;
 
   // receive messages
-  char *buffer = malloc(sizeof(char) * BUFSIZE);
-  memset(buffer, 0, sizeof(char) * BUFSIZE);
+  // the buffer comes with the pooled node, it is reused for the replay too
+  char *buffer = node->buffer;
 
   int read_bytes = 0;
-  char *line = NULL;
+#if !USE_AESD_CHAR_DEVICE
   ssize_t read_count;
+#endif
 
-  while ((read_bytes = recv(node->clientfd, buffer, BUFSIZE, 0)) > 0) {
-    syslog(LOG_DEBUG, "buffer read: %s", buffer);
+  while ((read_bytes = conn_recv(node, buffer, node->buf_size)) > 0) {
+    AESD_TRACE2(recv, node->clientfd, read_bytes);
+    // pace clients that go over their rate before they get to the log lock
+    client_limit_throttle(&limits, node->limit, read_bytes);
+    syslog(LOG_DEBUG, "buffer read: %.*s", read_bytes, buffer);
     char *newline_pos = (char *)memchr(buffer, '\n', read_bytes);
 
+    // the compression command only changes how replays are sent, it is not
+    // written to the log
+    if (newline_pos != NULL &&
+        strncmp(buffer, AESD_COMPRESSCMD, AESD_COMPRESSCMD_LEN) == 0) {
+      handle_compress_cmd(node, buffer, newline_pos - buffer);
+      continue;
+    }
+
+    // selecting a channel only changes which log the connection uses
+    if (newline_pos != NULL &&
+        strncmp(buffer, CHANNEL_CMD, CHANNEL_CMD_LEN) == 0) {
+      handle_channel_cmd(node, buffer, newline_pos - buffer);
+      continue;
+    }
+
+    // record and range queries are answered from the index without
+    // touching the log
+    if (newline_pos != NULL &&
+        handle_query_cmd(node, buffer, newline_pos - buffer)) {
+      continue;
+    }
+
+    // bulk submission of a memfd passed along with the command
+    if (newline_pos != NULL &&
+        strncmp(buffer, AESD_MEMFDCMD, AESD_MEMFDCMD_LEN) == 0) {
+      handle_memfd_cmd(node);
+      continue;
+    }
+
+    // a replication request takes the connection over until it ends
+    if (newline_pos != NULL &&
+        strncmp(buffer, AESD_REPLICATECMD, AESD_REPLICATECMD_LEN) == 0) {
+      handle_replicate_cmd(node, buffer, newline_pos - buffer);
+      break;
+    }
+
     // found a newline in the buffer, write to the file and then
     // send file contents
     if (newline_pos != NULL) {
+      size_t replayed = 0;
 
-      pthread_mutex_lock(&(fwl->file_mut));
+      AESD_TRACE2(lock_acquire, node->fwl, node->clientfd);
+      fair_lock_acquire(&node->fwl->file_mut);
+      AESD_TRACE2(lock_acquired, node->fwl, node->clientfd);
 #if !USE_AESD_CHAR_DEVICE
-      if (fwl->file == NULL) {
+      if (node->fwl->file == NULL) {
         syslog(LOG_ERR, "File pointer is NULL");
-        pthread_mutex_unlock(&(fwl->file_mut));
-        pthread_exit(NULL);
+        AESD_TRACE2(lock_release, node->fwl, node->clientfd);
+        fair_lock_release(&node->fwl->file_mut);
+        break;
+      }
+      // a replica only takes data from its primary, a write still gets the
+      // replay
+      if (repl.enabled) {
+        syslog(LOG_DEBUG, "Read only replica, not appending from %s",
+               node->ipstr);
+      } else {
+        // the +1 is there to include the newline character from the buffer
+        AESD_TRACE4(append, node->clientfd, node->fwl, node->fwl->size,
+                    newline_pos - buffer + 1);
+        file_with_lock_append(node->fwl, buffer, newline_pos - buffer + 1);
       }
-      // the +1 is there to include the newline character from the buffer
-      fwrite(buffer, sizeof(char), newline_pos - buffer + 1, fwl->file);
-      // fflush is here to force the file to be written and not stored
-      // in the kernel buffer
-      fflush(fwl->file);
 
-      rewind(fwl->file);
+      AESD_TRACE3(replay_start, node->clientfd, node->fwl, node->fwl->size);
+      replay_cork(node->clientfd, true);
+      if (node->compress) {
+        replayed = replay_file_compressed(node, node->fwl, node->fwl->size);
+      } else if (framed) {
+        struct log_cursor cur;
+        log_cursor_at(node->fwl, 0, &cur);
+        replayed = send_log_span(node, node->fwl, &cur, node->fwl->size);
+      } else {
+        rewind(node->fwl->file);
 
-      size_t len = 0;
-      while ((read_count = getline(&line, &len, fwl->file)) != -1) {
-        // syslog(LOG_INFO, "Sending line %s", line);
-        send(node->clientfd, line, read_count, 0);
+        while ((read_count = fread(buffer, sizeof(char), node->buf_size,
+                                   node->fwl->file)) > 0) {
+          send(node->clientfd, buffer, read_count, 0);
+          AESD_TRACE2(send, node->clientfd, read_count);
+          replayed += read_count;
+        }
       }
+      replay_cork(node->clientfd, false);
+      AESD_TRACE3(replay_end, node->clientfd, node->fwl, replayed);
 #else
-      int char_dev = open(AESDFILE, O_RDWR);
+      // reads at the end of the device block for new writes, a replay stops
+      // at the end instead when the read fails with EAGAIN
+      int char_dev = open(log_path, O_RDWR | O_NONBLOCK);
       // check for the seekto command
       if (strncmp(buffer, AESD_IOCTLSEEKTOCMD, AESD_IOCTLSEEKTOCMD_LEN) == 0) {
         syslog(LOG_INFO, "aesd ioctl cmd found, parsing...");
@@ -230,45 +3587,70 @@ void *handle_connection(void *_node) {
         }
         syslog(LOG_INFO, "parsed ioctl: cmd: %u, cmd_offset: %u",
                seekto.write_cmd, seekto.write_cmd_offset);
-        while ((read_count = read(char_dev, buffer, sizeof(buffer))) > 0) {
-          // syslog(LOG_INFO, "Sending line to driver: %s", buffer);
-          send(node->clientfd, buffer, read_count, 0);
+        // the device size is not known here, the driver tracepoints
+        // carry the offsets
+        AESD_TRACE3(replay_start, node->clientfd, node->fwl, -1);
+        replay_cork(node->clientfd, true);
+        if (node->compress) {
+          replayed = replay_fd_compressed(node, char_dev);
+        } else {
+          replayed = replay_fd_plain(node, char_dev);
         }
+        replay_cork(node->clientfd, false);
       } else {
+        AESD_TRACE4(append, node->clientfd, node->fwl, -1,
+                    newline_pos - buffer + 1);
         write(char_dev, buffer, newline_pos - buffer + 1);
         lseek(char_dev, 0, SEEK_SET);
-        while ((read_count = read(char_dev, buffer, sizeof(buffer))) > 0) {
-            // syslog(LOG_INFO, "Sending line to driver: %s", buffer);
-            send(node->clientfd, buffer, read_count, 0);
-          }
+        AESD_TRACE3(replay_start, node->clientfd, node->fwl, -1);
+        replay_cork(node->clientfd, true);
+        if (node->compress) {
+          replayed = replay_fd_compressed(node, char_dev);
+        } else {
+          replayed = replay_fd_plain(node, char_dev);
+        }
+        replay_cork(node->clientfd, false);
       }
+      AESD_TRACE3(replay_end, node->clientfd, node->fwl, replayed);
       close(char_dev);
 #endif
-      pthread_mutex_unlock(&(fwl->file_mut));
+      AESD_TRACE2(lock_release, node->fwl, node->clientfd);
+      fair_lock_release(&node->fwl->file_mut);
     } else {
       // no newline character found, add whole buffer to file
-      pthread_mutex_lock(&(fwl->file_mut));
+      AESD_TRACE2(lock_acquire, node->fwl, node->clientfd);
+      fair_lock_acquire(&node->fwl->file_mut);
+      AESD_TRACE2(lock_acquired, node->fwl, node->clientfd);
 #if !USE_AESD_CHAR_DEVICE
-      fwrite(buffer, sizeof(char), read_bytes, fwl->file);
-      fflush(fwl->file);
+      if (!repl.enabled) {
+        AESD_TRACE4(append, node->clientfd, node->fwl, node->fwl->size,
+                    read_bytes);
+        file_with_lock_append(node->fwl, buffer, read_bytes);
+      }
 #else
-      int char_dev = open(AESDFILE, O_RDWR);
+      AESD_TRACE4(append, node->clientfd, node->fwl, -1, read_bytes);
+      int char_dev = open(log_path, O_RDWR);
       write(char_dev, buffer, read_bytes);
       close(char_dev);
 #endif
-      pthread_mutex_unlock(&(fwl->file_mut));
+      AESD_TRACE2(lock_release, node->fwl, node->clientfd);
+      fair_lock_release(&node->fwl->file_mut);
     }
   }
 
-  node->operation_complete = true;
-  free(line);
-  free(buffer);
   if (read_bytes == 0) {
     syslog(LOG_INFO, "Closed connection from %s", node->ipstr);
   }
   if (read_bytes == -1) {
     syslog(LOG_ERR, "Error reading all bytes from server");
   }
+  if (node->passed_fd != -1) {
+    close(node->passed_fd);
+    node->passed_fd = -1;
+  }
+  // node belongs to the connection table from here on, do not touch it after
+  // signalling completion
+  conn_table_complete(&conns, node);
   pthread_exit(NULL);
 }
 
@@ -313,43 +3695,238 @@ void *handle_timestamp() {
     }
 
     // everything looks ok, write to file
-    pthread_mutex_lock(&(fwl->file_mut));
+    fair_lock_acquire(&fwl->file_mut);
     if (fwl->file == NULL) {
       syslog(LOG_ERR, "File pointer is NULL");
-      pthread_mutex_unlock(&(fwl->file_mut));
+      fair_lock_release(&fwl->file_mut);
       pthread_exit(NULL);
     }
-    fwrite(outstr, sizeof(char), sizeof(outstr), fwl->file);
-    fflush(fwl->file);
-    pthread_mutex_unlock(&(fwl->file_mut));
+    // only the formatted line, not the whole (zero padded) buffer
+    file_with_lock_append(fwl, outstr, strlen(outstr));
+    fair_lock_release(&fwl->file_mut);
     // sleep(10);
   }
 
   pthread_exit(NULL);
 }
 
+/**
+ * handle_checkpoint is a pthread function that checkpoints the default log
+ * and every channel every CHECKPOINT_INTERVAL_S seconds in persistent mode
+ */
+void *handle_checkpoint() {
+  struct timespec wakey;
+  clock_gettime(CLOCK_MONOTONIC, &wakey);
+
+  while (!shutdown_flag) {
+    wakey.tv_sec += CHECKPOINT_INTERVAL_S;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakey, NULL);
+    if (shutdown_flag) {
+      break;
+    }
+    file_with_lock_checkpoint(fwl);
+    for (int i = 0; i < CHANNEL_BUCKETS; i++) {
+      pthread_rwlock_rdlock(&channels.buckets[i].lock);
+      for (struct channel *ch = channels.buckets[i].head; ch != NULL;
+           ch = ch->next) {
+        file_with_lock_checkpoint(ch->fwl);
+      }
+      pthread_rwlock_unlock(&channels.buckets[i].lock);
+    }
+  }
+  pthread_exit(NULL);
+}
+
 /**
  * raise_shutdown_flag catches the SIG_INT and SIG_TERM signals and changes
  * the `shutdown_flag` to (1), causing the infinite while loops to exit
  * and close the program
  */
-void raise_shutdown_flag(int signo) { shutdown_flag = 1; }
+void raise_shutdown_flag(int signo) {
+  shutdown_flag = 1;
+  // the signal may land on a connection thread, poke the completion eventfd
+  // so the accept loop wakes up from poll and sees the flag
+  uint64_t one = 1;
+  if (write(conns.done_fd, &one, sizeof one) == -1) {
+    // nothing more can be done from a signal handler
+  }
+}
+
+/**
+ * raise_stats_flag catches SIGUSR1 and asks the accept loop to write the
+ * server counters to syslog
+ */
+void raise_stats_flag(int signo) {
+  stats_flag = 1;
+  uint64_t one = 1;
+  if (write(conns.done_fd, &one, sizeof one) == -1) {
+    // nothing more can be done from a signal handler
+  }
+}
+
+/**
+ * log_stats writes the server counters to syslog
+ */
+void log_stats(void) {
+  for (int node = 0; node < AFF_MAX_NODES; node++) {
+    conn_pool_log_stats(&conn_pools[node]);
+  }
+  fair_lock_acquire(&fwl->file_mut);
+  syslog(LOG_INFO, "admission: %lu connections rejected, %lu packets throttled",
+         limits.conns_rejected, limits.throttled);
+  syslog(LOG_INFO,
+         "replay cache: %zu blocks in %zu bytes, %lu compressed, %lu reused",
+         fwl->block_count, fwl->block_bytes, fwl->blocks_compressed,
+         fwl->blocks_reused);
+  fair_lock_release(&fwl->file_mut);
+  if (repl.enabled) {
+    replica_log_stats(&repl);
+  }
+  if (udp.enabled) {
+    udp_log_stats(&udp);
+  }
+}
 
 void print_usage(void) {
   printf("USAGE for aesdsocket\n");
-  printf("aesdsocket [-d]\n");
+  printf("aesdsocket [-d] [-b bytes] [-n count] [-c cpulist [-s]] [-m conns] "
+         "[-r pkts] [-R bytes] [-p port] [-f path] [-P host:port] [-k] [-C]\n"
+         "           [-u path] [-U port]\n");
   printf("OPTIONS:\n");
   printf("\t-d: run aesdsocket as a daemon\n");
+  printf("\t-b: per connection buffer size in bytes (default %d)\n", BUFSIZE);
+  printf("\t-n: connection objects kept in the pool (default %d)\n",
+         POOL_DEFAULT_SIZE);
+  printf("\t-c: pin threads to the listed cpus, e.g. 0-3,8\n");
+  printf("\t-s: pin each connection to the cpu its packets arrive on\n");
+  printf("\t-m: max connections per client address (default unlimited)\n");
+  printf("\t-r: max packets per second per client address\n");
+  printf("\t-R: max bytes per second per client address\n");
+  printf("\t-p: port to listen on (default %s)\n", PORT);
+  printf("\t-f: log file (default %s)\n", AESDFILE);
+  printf("\t-P: run as a read only replica of the primary at host:port\n");
+  printf("\t-k: keep the log across restarts\n");
+  printf("\t-C: frame every record with its length and crc32c, checked on "
+         "recovery\n");
+  printf("\t-u: also listen on a unix domain socket at path\n");
+  printf("\t-U: also take records as udp datagrams on port, no replies\n");
+}
+
+/**
+ * parse_size parses a positive decimal number for the command line options
+ *
+ * Returns 0 on success, -1 if `arg` is not a valid number
+ */
+int parse_size(const char *arg, size_t *out) {
+  char *end;
+  errno = 0;
+  unsigned long long val = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0') {
+    return -1;
+  }
+  *out = val;
+  return 0;
 }
 
 int main(int argc, char **argv) {
 
-  bool daemon;
-  if (argc == 2 && strncmp(argv[1], "-d", 2) == 0) {
-    daemon = true;
-  } else if (argc == 1) {
-    daemon = false;
-  } else {
+  bool daemon = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "db:n:c:sm:r:R:p:f:P:kCu:U:")) != -1) {
+    switch (opt) {
+    case 'd':
+      daemon = true;
+      break;
+    case 'b':
+      if (parse_size(optarg, &pool_buf_size) == -1 || pool_buf_size == 0) {
+        print_usage();
+        return (-1);
+      }
+      break;
+    case 'n':
+      if (parse_size(optarg, &pool_max_free) == -1) {
+        print_usage();
+        return (-1);
+      }
+      break;
+    case 'c':
+      if (affinity_parse(&aff, optarg) == -1) {
+        print_usage();
+        return (-1);
+      }
+      break;
+    case 's':
+      aff.steer_incoming = true;
+      break;
+    case 'm':
+    case 'r':
+    case 'R': {
+      size_t val;
+      if (parse_size(optarg, &val) == -1) {
+        print_usage();
+        return (-1);
+      }
+      if (opt == 'm') {
+        limits.max_conns_per_ip = val;
+      } else if (opt == 'r') {
+        limits.pkt_rate = val;
+      } else {
+        limits.byte_rate = val;
+      }
+      break;
+    }
+    case 'p':
+      listen_port = optarg;
+      break;
+    case 'f':
+      log_path = optarg;
+      break;
+    case 'P':
+      if (USE_AESD_CHAR_DEVICE || replica_parse(&repl, optarg) == -1) {
+        print_usage();
+        return (-1);
+      }
+      break;
+    case 'k':
+      if (USE_AESD_CHAR_DEVICE) {
+        print_usage();
+        return (-1);
+      }
+      persistent = true;
+      break;
+    case 'C':
+      if (USE_AESD_CHAR_DEVICE) {
+        print_usage();
+        return (-1);
+      }
+      framed = true;
+      break;
+    case 'u': {
+      // stored absolute, the daemon changes directory before it is removed
+      char cwd[PATH_MAX];
+      int len;
+      if (optarg[0] == '/' || getcwd(cwd, sizeof cwd) == NULL) {
+        len = snprintf(local_path, sizeof local_path, "%s", optarg);
+      } else {
+        len = snprintf(local_path, sizeof local_path, "%s/%s", cwd, optarg);
+      }
+      if (len < 0 || (size_t)len >= sizeof local_path) {
+        print_usage();
+        return (-1);
+      }
+      break;
+    }
+    case 'U':
+      udp.enabled = true;
+      udp.port = optarg;
+      break;
+    default:
+      print_usage();
+      return (-1);
+    }
+  }
+  // a replica only takes data from its primary
+  if (optind != argc || (udp.enabled && repl.enabled)) {
     print_usage();
     return (-1);
   }
@@ -362,6 +3939,14 @@ int main(int argc, char **argv) {
   // avoid signal blocking issues
   sigemptyset(&sa.sa_mask);
   sigaction(SIGTERM, &sa, NULL);
+  // a client that disconnects in the middle of a replay must only end its
+  // own connection, not the whole server
+  struct sigaction sa_pipe = {.sa_handler = SIG_IGN};
+  sigemptyset(&sa_pipe.sa_mask);
+  sigaction(SIGPIPE, &sa_pipe, NULL);
+  struct sigaction sa_stats = {.sa_handler = &raise_stats_flag};
+  sigemptyset(&sa_stats.sa_mask);
+  sigaction(SIGUSR1, &sa_stats, NULL);
 
   openlog("aesdsocket", LOG_PID, LOG_USER);
   int sockfd;
@@ -381,7 +3966,7 @@ int main(int argc, char **argv) {
   hints.ai_flags = AI_PASSIVE;
 
   int status;
-  if ((status = getaddrinfo(NULL, PORT, &hints, &res)) != 0) {
+  if ((status = getaddrinfo(NULL, listen_port, &hints, &res)) != 0) {
     syslog(LOG_ERR, "Error getting addrinfo");
     closelog();
     return (-1);
@@ -465,55 +4050,133 @@ int main(int argc, char **argv) {
     return (-1);
   }
 
-  // now can accept incoming connections
-  fwl = malloc(sizeof(struct file_with_lock));
-  fwl->file = NULL;
-  if (pthread_mutex_init(&(fwl->file_mut), NULL) < 0) {
-    syslog(LOG_ERR, "Error initializing mutex");
+  // local producers skip the TCP stack, the protocol is the same
+  int localfd = -1;
+  if (local_path[0] != '\0' && (localfd = local_listen(local_path)) == -1) {
     freeaddrinfo(res);
     closelog();
     close(sockfd);
     return (-1);
   }
 
-  // check if the file already exists (bad exit could cause this)
-  // and delete it before creating a new one
-#if !USE_AESD_CHAR_DEVICE
-  FILE *aesd_exists = fopen(AESDFILE, "r");
-  if (aesd_exists != NULL) {
-    fclose(aesd_exists);
-    remove(AESDFILE);
+  if (udp.enabled && (udp.fd = udp_listen(udp.port)) == -1) {
+    freeaddrinfo(res);
+    closelog();
+    close(sockfd);
+    if (localfd != -1) {
+      close(localfd);
+      unlink(local_path);
+    }
+    return (-1);
   }
 
-  // create file to read/write to
-  fwl->file = fopen(AESDFILE, "a+");
-  if (fwl->file == NULL) {
-    syslog(LOG_ERR, "Error on opening aesdfile");
+  // now can accept incoming connections
+  fwl = file_with_lock_new(log_path);
+  if (fwl == NULL) {
     freeaddrinfo(res);
     closelog();
     close(sockfd);
-    pthread_mutex_destroy(&(fwl->file_mut));
     return (-1);
   }
-#endif
+  channel_map_init(&channels);
+  client_limits_init(&limits);
 
   // start the timestamp thread
   pthread_t ts_thread;
+  bool ts_running = false;
 
 #if !USE_AESD_CHAR_DEVICE
-  bool start_timestamp = true;
+  // a replica gets the timestamps of its primary
+  bool start_timestamp = !repl.enabled;
 #else
   bool start_timestamp = false;
 #endif
 
-  struct client_thread_node *head = NULL;
+  if (aff.enabled &&
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &aff.cpus) !=
+          0) {
+    syslog(LOG_ERR, "Error pinning the accept loop to the cpu list");
+  }
+
+  if (conn_pools_init() == -1) {
+    syslog(LOG_ERR, "Error filling connection pool");
+    freeaddrinfo(res);
+    closelog();
+    close(sockfd);
+    conn_pools_destroy();
+    file_with_lock_free(fwl);
+    return (-1);
+  }
+
+  if (conn_table_init(&conns) == -1) {
+    syslog(LOG_ERR, "Error initializing connection table");
+    freeaddrinfo(res);
+    closelog();
+    close(sockfd);
+    conn_pools_destroy();
+    file_with_lock_free(fwl);
+    return (-1);
+  }
+
+  pthread_t ckpt_thread;
+  bool ckpt_running =
+      persistent &&
+      pthread_create(&ckpt_thread, NULL, handle_checkpoint, NULL) == 0;
+
+  if (repl.enabled &&
+      pthread_create(&repl.thread, NULL, replica_thread, &repl) != 0) {
+    syslog(LOG_ERR, "Error starting the replication thread");
+    repl.enabled = false;
+  }
+
+  if (udp.enabled && pthread_create(&udp.thread, NULL, handle_udp, &udp) != 0) {
+    syslog(LOG_ERR, "Error starting the udp thread");
+    close(udp.fd);
+    udp.enabled = false;
+  }
+
+  // poll skips the local listener when it is -1
+  struct pollfd pfds[3] = {
+      {.fd = sockfd, .events = POLLIN},
+      {.fd = conns.done_fd, .events = POLLIN},
+      {.fd = localfd, .events = POLLIN},
+  };
 
   // shutdown_flag is raised when SIGINT or SIGTERM is raised
   // this way the while loop has a way to exit
   while (!shutdown_flag) {
+    if (poll(pfds, 3, -1) == -1) {
+      if (errno != EINTR) {
+        syslog(LOG_ERR, "Error on poll");
+      }
+      continue;
+    }
+
+    // join finished connections as soon as they report in, independently of
+    // new clients arriving
+    if (pfds[1].revents & POLLIN) {
+      conn_table_reap(&conns);
+    }
+
+    if (stats_flag) {
+      stats_flag = 0;
+      log_stats();
+    }
+
+    // one client per round, the other listener is still ready on the next
+    // poll
+    int listenfd = -1;
+    if (pfds[0].revents & POLLIN) {
+      listenfd = sockfd;
+    } else if (pfds[2].revents & POLLIN) {
+      listenfd = localfd;
+    } else {
+      continue;
+    }
+
     struct sockaddr_storage inc_addr;
     socklen_t inc_addr_size = sizeof inc_addr;
-    clientfd = accept(sockfd, (struct sockaddr *)&inc_addr, &inc_addr_size);
+    clientfd = accept(listenfd, (struct sockaddr *)&inc_addr, &inc_addr_size);
     if (clientfd == -1) {
       if (shutdown_flag)
         break;
@@ -522,75 +4185,100 @@ int main(int argc, char **argv) {
     }
 
     if (start_timestamp) {
-      pthread_create(&ts_thread, NULL, handle_timestamp, NULL);
+      ts_running =
+          pthread_create(&ts_thread, NULL, handle_timestamp, NULL) == 0;
       start_timestamp = false;
     }
 
+    struct client_limit *limit = client_limit_admit(&limits, &inc_addr);
+    if (limit == NULL) {
+      syslog(LOG_INFO, "Too many connections from client, rejecting");
+      close(clientfd);
+      continue;
+    }
+
+    int cpu = affinity_pick_cpu(&aff, clientfd);
     struct client_node *c_node =
-        client_node_new(clientfd, inc_addr, inc_addr_size);
+        client_node_new(clientfd, inc_addr, inc_addr_size, cpu);
     if (c_node == NULL) {
+      client_limit_release(&limits, limit);
+      close(clientfd);
       break;
     }
+    c_node->limit = limit;
 
-    pthread_t tid;
-    pthread_create(&tid, NULL, handle_connection, (void *)c_node);
-
-    struct client_thread_node *ct_node =
-        malloc(sizeof(struct client_thread_node));
-    if (ct_node == NULL) {
-      break;
+    int idx = conn_table_alloc(&conns, c_node);
+    if (idx == CONN_SLOT_NONE) {
+      syslog(LOG_ERR, "Connection table full, dropping %s", c_node->ipstr);
+      client_limit_release(&limits, limit);
+      close(clientfd);
+      conn_pool_put(&conn_pools[c_node->numa_node], c_node);
+      continue;
     }
-    ct_node->client_node = c_node;
-    ct_node->tid = tid;
-    ct_node->next = NULL;
-
-    list_add_to_start(&head, ct_node);
 
-    struct client_thread_node *current = head;
-
-    while (current != NULL) {
-      if (current->client_node->operation_complete == true) {
-        pthread_t join_id = current->tid;
-        syslog(LOG_INFO, "Removing thread with id %lu", join_id);
-
-        shutdown(current->client_node->clientfd, SHUT_RDWR);
-        pthread_join(join_id, NULL);
-        struct client_thread_node *temp = current->next;
-        list_remove_using_client_file_node(&head, current);
-        current = temp;
-      } else {
-        current = current->next;
-      }
+    // the thread starts out on its cpu, so everything it touches from the
+    // first instruction on is local to that cpu's node
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+      cpu_set_t one_cpu;
+      CPU_ZERO(&one_cpu);
+      CPU_SET(cpu, &one_cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &one_cpu);
     }
+    if (pthread_create(&conns.slots[idx].tid, &attr, handle_connection,
+                       (void *)c_node) != 0) {
+      syslog(LOG_ERR, "Error creating thread for %s", c_node->ipstr);
+      conn_table_release(&conns, idx);
+    }
+    pthread_attr_destroy(&attr);
   }
 
   syslog(LOG_INFO, "Cleaning up, exit signal caught");
-  // cleanup any remaining threads
-  while (head != NULL) {
-    pthread_cancel(head->tid);
-    pthread_join(head->tid, NULL);
-    shutdown(head->client_node->clientfd, SHUT_RDWR);
-
-    struct client_thread_node *temp = head->next;
-    list_remove_head(&head);
-    head = temp;
+  if (repl.enabled) {
+    replica_stop(&repl);
+  }
+  if (udp.enabled) {
+    // interrupts recvmmsg, the handler only raises shutdown_flag again
+    pthread_kill(udp.thread, SIGTERM);
+    pthread_join(udp.thread, NULL);
+    close(udp.fd);
+  }
+  if (ckpt_running) {
+    // cuts the sleep short, the handler only raises shutdown_flag again
+    pthread_kill(ckpt_thread, SIGTERM);
+    pthread_join(ckpt_thread, NULL);
   }
+  // cleanup any remaining threads, shutting the socket down makes the
+  // blocking recv return so each thread leaves through its normal exit path
+  for (int i = 0; i < CONN_TABLE_SIZE; i++) {
+    if (!conns.slots[i].in_use) {
+      continue;
+    }
+    shutdown(conns.slots[i].client_node->clientfd, SHUT_RDWR);
+    pthread_join(conns.slots[i].tid, NULL);
+    conn_table_release(&conns, i);
+  }
+  conn_table_destroy(&conns);
+  log_stats();
+  conn_pools_destroy();
 
-#if !USE_AESD_CHAR_DEVICE
-  pthread_cancel(ts_thread);
-  pthread_join(ts_thread, NULL);
-#endif
+  // the timestamp thread only starts with the first client
+  if (ts_running) {
+    pthread_cancel(ts_thread);
+    pthread_join(ts_thread, NULL);
+  }
 
   freeaddrinfo(res);
   shutdown(sockfd, SHUT_RDWR);
+  if (localfd != -1) {
+    close(localfd);
+    unlink(local_path);
+  }
   closelog();
+  channel_map_destroy(&channels);
+  client_limits_destroy(&limits);
   file_with_lock_free(fwl);
-#if !USE_AESD_CHAR_DEVICE
-  // if the character device is being used, the device file should not be
-  // deleted
-  // otherwise, delete the temporary file
-  remove(AESDFILE);
-#endif
   if (daemon) {
     close(dev_null);
   }
@@ -0,0 +1,380 @@
+/**
+ * @file Test_circular_buffer_ring.c
+ * @brief Tests of the resizable ring behind aesd-circular-buffer.c: storage
+ * changes, dropping entries and free running counters that wrap around
+ */
+
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "unity.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_TEST_RECORDS 64
+
+// "w<n>" padded to between 2 and 8 bytes and a newline, so that entries
+// differ in size
+static char records[RING_TEST_RECORDS][16];
+
+static void records_init(void) {
+  for (unsigned int i = 0; i < RING_TEST_RECORDS; i++) {
+    snprintf(records[i], sizeof records[i], "w%u%.*s\n", i, (int)(i % 5),
+             "xxxxx");
+  }
+}
+
+/**
+ * Adds records @param first to @param last (exclusive) to @param buffer and
+ * checks that each add replaces the record @param depth before it once the
+ * ring is full
+ */
+static void add_records(struct aesd_circular_buffer *buffer, uint32_t first,
+                        uint32_t last, uint32_t depth) {
+  for (uint32_t i = first; i < last; i++) {
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    struct aesd_buffer_entry entry = {.buffptr = records[i],
+                                      .size = strlen(records[i])};
+    const char *replaced = aesd_circular_buffer_add_entry(buffer, &entry);
+    if (count == depth) {
+      TEST_ASSERT_EQUAL_PTR_MESSAGE(records[i - depth], replaced,
+                                    "the oldest entry is replaced when full");
+    } else {
+      TEST_ASSERT_NULL_MESSAGE(replaced, "nothing is replaced until full");
+    }
+  }
+}
+
+/**
+ * Checks that @param buffer holds records @param first to @param first +
+ * @param count, oldest first, and that its byte count matches
+ */
+static void check_ring(struct aesd_circular_buffer *buffer, uint32_t first,
+                       uint32_t count) {
+  size_t size = 0;
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(count, aesd_circular_buffer_count(buffer),
+                                   "entry count");
+  for (uint32_t i = 0; i < count; i++) {
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, i);
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "stored entry missing");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(records[first + i], entry->buffptr,
+                                  "entries are kept oldest first");
+    size += entry->size;
+  }
+  TEST_ASSERT_NULL(aesd_circular_buffer_entry_at(buffer, count));
+  TEST_ASSERT_EQUAL_size_t_MESSAGE(size, aesd_circular_buffer_size(buffer),
+                                   "byte count");
+}
+
+/**
+ * Counts the slots of @param buffer that still point at a record
+ */
+static uint32_t used_slots(struct aesd_circular_buffer *buffer) {
+  struct aesd_buffer_entry *entry;
+  uint32_t index;
+  uint32_t used = 0;
+  AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+    if (NULL != entry->buffptr) {
+      used++;
+    }
+  }
+  return used;
+}
+
+/**
+ * Checks that the first and the last byte of every entry of @param buffer
+ * map back to that entry, and that the byte after the last entry maps to
+ * none
+ */
+static void check_fpos(struct aesd_circular_buffer *buffer) {
+  size_t fpos = 0;
+  size_t offset;
+  struct aesd_buffer_entry *entry;
+  for (uint32_t i = 0; (entry = aesd_circular_buffer_entry_at(buffer, i));
+       i++) {
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(
+        fpos, aesd_circular_buffer_entry_fpos(buffer, entry),
+        "entry fpos is the sum of the sizes before it");
+    offset = SIZE_MAX;
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(
+        entry,
+        aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset),
+        "first byte of an entry");
+    TEST_ASSERT_EQUAL_size_t(0, offset);
+    offset = SIZE_MAX;
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(
+        entry,
+        aesd_circular_buffer_find_entry_offset_for_fpos(
+            buffer, fpos + entry->size - 1, &offset),
+        "last byte of an entry");
+    TEST_ASSERT_EQUAL_size_t(entry->size - 1, offset);
+    fpos += entry->size;
+  }
+  TEST_ASSERT_EQUAL_size_t(aesd_circular_buffer_size(buffer), fpos);
+  offset = SIZE_MAX;
+  TEST_ASSERT_NULL_MESSAGE(
+      aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset),
+      "nothing past the end");
+  TEST_ASSERT_EQUAL_size_t_MESSAGE(SIZE_MAX, offset,
+                                   "offset untouched when nothing is found");
+}
+
+void test_circular_buffer_ring_grow(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  add_records(&buffer, 0, 12, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+  check_ring(&buffer, 2, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+  TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+                           used_slots(&buffer));
+
+  struct aesd_buffer_entry *heap = calloc(64, sizeof(*heap));
+  TEST_ASSERT_NOT_NULL(heap);
+  TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_resize(&buffer, heap, 64, 40),
+                           "the inline storage is not handed back");
+  TEST_ASSERT_EQUAL_PTR(heap, buffer.entry);
+  TEST_ASSERT_FALSE(buffer.full);
+  TEST_ASSERT_EQUAL_UINT32(10, used_slots(&buffer));
+  check_ring(&buffer, 2, 10);
+
+  // room for 30 more before the oldest goes
+  add_records(&buffer, 12, 42, 40);
+  TEST_ASSERT_TRUE(buffer.full);
+  check_ring(&buffer, 2, 40);
+  add_records(&buffer, 42, 45, 40);
+  check_ring(&buffer, 5, 40);
+  TEST_ASSERT_EQUAL_UINT32(40, used_slots(&buffer));
+
+  free(heap);
+}
+
+void test_circular_buffer_ring_shrink_to_inline(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  struct aesd_buffer_entry *heap = calloc(64, sizeof(*heap));
+  TEST_ASSERT_NOT_NULL(heap);
+  TEST_ASSERT_NULL(aesd_circular_buffer_resize(&buffer, heap, 64, 40));
+  add_records(&buffer, 0, 40, 40);
+  check_ring(&buffer, 0, 40);
+
+  // entries beyond the new depth are dropped oldest first before resizing
+  for (uint32_t i = 0; i < 35; i++) {
+    TEST_ASSERT_EQUAL_PTR(records[i],
+                          aesd_circular_buffer_remove_oldest(&buffer));
+    TEST_ASSERT_FALSE(buffer.full);
+  }
+  check_ring(&buffer, 35, 5);
+
+  TEST_ASSERT_EQUAL_PTR_MESSAGE(heap,
+                                aesd_circular_buffer_resize(&buffer, NULL, 0,
+                                                            5),
+                                "the heap storage is handed back to free");
+  free(heap);
+  TEST_ASSERT_EQUAL_PTR(buffer.inline_entry, buffer.entry);
+  TEST_ASSERT_EQUAL_UINT32(AESDCHAR_INLINE_ENTRIES, buffer.capacity);
+  TEST_ASSERT_TRUE(buffer.full);
+  check_ring(&buffer, 35, 5);
+  TEST_ASSERT_EQUAL_UINT32(5, used_slots(&buffer));
+
+  add_records(&buffer, 40, 47, 5);
+  check_ring(&buffer, 42, 5);
+  // with depth below capacity replaced slots are cleared, not reused
+  TEST_ASSERT_EQUAL_UINT32(5, used_slots(&buffer));
+
+  // shrinking in place keeps the storage
+  for (uint32_t i = 42; i < 44; i++) {
+    TEST_ASSERT_EQUAL_PTR(records[i],
+                          aesd_circular_buffer_remove_oldest(&buffer));
+  }
+  TEST_ASSERT_NULL(aesd_circular_buffer_resize(&buffer, NULL, 0, 3));
+  TEST_ASSERT_TRUE(buffer.full);
+  add_records(&buffer, 47, 49, 3);
+  check_ring(&buffer, 46, 3);
+
+  // draining the ring leaves it empty, not full
+  for (uint32_t i = 46; i < 49; i++) {
+    TEST_ASSERT_EQUAL_PTR(records[i],
+                          aesd_circular_buffer_remove_oldest(&buffer));
+  }
+  TEST_ASSERT_NULL(aesd_circular_buffer_remove_oldest(&buffer));
+  check_ring(&buffer, 49, 0);
+  TEST_ASSERT_EQUAL_UINT32(0, used_slots(&buffer));
+}
+
+void test_circular_buffer_ring_counter_wrap(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  // an empty ring may start at any count, start close to the wrap so that
+  // out_offs stays below it while in_offs passes it
+  buffer.in_offs = UINT32_MAX - 20;
+  buffer.out_offs = UINT32_MAX - 20;
+  buffer.bytes_in = SIZE_MAX - 100;
+  buffer.bytes_out = SIZE_MAX - 100;
+
+  add_records(&buffer, 0, 25, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+  TEST_ASSERT_TRUE_MESSAGE(buffer.in_offs < buffer.out_offs,
+                           "in_offs wrapped and out_offs did not");
+  TEST_ASSERT_TRUE_MESSAGE(buffer.bytes_in < buffer.bytes_out,
+                           "bytes_in wrapped and bytes_out did not");
+  TEST_ASSERT_TRUE(buffer.full);
+  check_ring(&buffer, 15, 10);
+
+  // growing copies the entries out oldest first and restarts the counts
+  struct aesd_buffer_entry *heap = calloc(32, sizeof(*heap));
+  TEST_ASSERT_NOT_NULL(heap);
+  TEST_ASSERT_NULL(aesd_circular_buffer_resize(&buffer, heap, 32, 20));
+  TEST_ASSERT_EQUAL_UINT32(0, buffer.out_offs);
+  TEST_ASSERT_EQUAL_UINT32(10, buffer.in_offs);
+  check_ring(&buffer, 15, 10);
+  add_records(&buffer, 25, 40, 20);
+  check_ring(&buffer, 20, 20);
+
+  free(heap);
+}
+
+void test_circular_buffer_ring_fpos_after_eviction(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+  check_fpos(&buffer);
+
+  // every count from empty to full, then a few rounds of eviction
+  for (uint32_t i = 0; i < 33; i++) {
+    add_records(&buffer, i, i + 1, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    check_fpos(&buffer);
+  }
+  check_ring(&buffer, 23, 10);
+
+  // fpos 0 follows the oldest entry as entries are removed
+  for (uint32_t i = 23; i < 33; i++) {
+    TEST_ASSERT_EQUAL_PTR(records[i],
+                          aesd_circular_buffer_remove_oldest(&buffer));
+    check_fpos(&buffer);
+  }
+}
+
+void test_circular_buffer_ring_fpos_deep(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  // an odd depth in larger storage, so the binary search sees every count
+  // up to 37 and slots wrap at a different place than the depth
+  struct aesd_buffer_entry *heap = calloc(64, sizeof(*heap));
+  TEST_ASSERT_NOT_NULL(heap);
+  TEST_ASSERT_NULL(aesd_circular_buffer_resize(&buffer, heap, 64, 37));
+  for (uint32_t i = 0; i < RING_TEST_RECORDS; i++) {
+    add_records(&buffer, i, i + 1, 37);
+    check_fpos(&buffer);
+  }
+  check_ring(&buffer, RING_TEST_RECORDS - 37, 37);
+
+  free(heap);
+}
+
+void test_circular_buffer_ring_fpos_wrapped_bytes(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  // positions are relative to bytes_out and stay right while the running
+  // byte counts wrap around underneath them
+  buffer.bytes_in = SIZE_MAX - 30;
+  buffer.bytes_out = SIZE_MAX - 30;
+  for (uint32_t i = 0; i < 20; i++) {
+    add_records(&buffer, i, i + 1, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    check_fpos(&buffer);
+  }
+  TEST_ASSERT_TRUE(buffer.bytes_out < SIZE_MAX - 30);
+}
+
+/**
+ * Checks that the entries of @param buffer are numbered consecutively from
+ * @param oldest and that each is found by its number
+ */
+static void check_seq(struct aesd_circular_buffer *buffer, uint64_t oldest) {
+  uint32_t count = aesd_circular_buffer_count(buffer);
+  TEST_ASSERT_EQUAL_UINT64(oldest, aesd_circular_buffer_oldest_seq(buffer));
+  TEST_ASSERT_EQUAL_UINT64(oldest + count, buffer->seq_in);
+  for (uint32_t i = 0; i < count; i++) {
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, i);
+    TEST_ASSERT_EQUAL_UINT64(oldest + i, entry->seq);
+    TEST_ASSERT_EQUAL_PTR(entry,
+                          aesd_circular_buffer_find_seq(buffer, oldest + i));
+  }
+  TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_seq(buffer, oldest - 1),
+                           "dropped entries are not found");
+  TEST_ASSERT_NULL_MESSAGE(
+      aesd_circular_buffer_find_seq(buffer, buffer->seq_in),
+      "the next number names no entry yet");
+  TEST_ASSERT_NULL(aesd_circular_buffer_find_seq(buffer, 0));
+}
+
+void test_circular_buffer_ring_seq_empty(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  // numbering starts at 1 and an empty ring's oldest is the next number
+  TEST_ASSERT_EQUAL_UINT64(1, buffer.seq_in);
+  check_seq(&buffer, 1);
+
+  add_records(&buffer, 0, 3, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+  check_seq(&buffer, 1);
+  for (uint32_t i = 0; i < 3; i++) {
+    aesd_circular_buffer_remove_oldest(&buffer);
+  }
+  check_seq(&buffer, 4);
+  TEST_ASSERT_EQUAL_UINT64(3, buffer.evicted);
+}
+
+void test_circular_buffer_ring_seq_after_eviction(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  add_records(&buffer, 0, 25, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+  check_seq(&buffer, 16);
+  TEST_ASSERT_EQUAL_UINT64(15, buffer.evicted);
+  TEST_ASSERT_EQUAL_PTR(records[15],
+                        aesd_circular_buffer_find_seq(&buffer, 16)->buffptr);
+  TEST_ASSERT_EQUAL_PTR(records[24],
+                        aesd_circular_buffer_find_seq(&buffer, 25)->buffptr);
+}
+
+void test_circular_buffer_ring_seq_across_resize(void) {
+  struct aesd_circular_buffer buffer;
+  records_init();
+  aesd_circular_buffer_init(&buffer);
+
+  add_records(&buffer, 0, 12, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+  check_seq(&buffer, 3);
+
+  // in_offs restarts on a storage change, the numbering does not
+  struct aesd_buffer_entry *heap = calloc(64, sizeof(*heap));
+  TEST_ASSERT_NOT_NULL(heap);
+  TEST_ASSERT_NULL(aesd_circular_buffer_resize(&buffer, heap, 64, 20));
+  check_seq(&buffer, 3);
+  add_records(&buffer, 12, 30, 20);
+  check_seq(&buffer, 11);
+
+  for (uint32_t i = 0; i < 16; i++) {
+    aesd_circular_buffer_remove_oldest(&buffer);
+  }
+  TEST_ASSERT_EQUAL_PTR(heap,
+                        aesd_circular_buffer_resize(&buffer, NULL, 0, 4));
+  free(heap);
+  check_seq(&buffer, 27);
+  add_records(&buffer, 30, 32, 4);
+  check_seq(&buffer, 29);
+  TEST_ASSERT_EQUAL_PTR(records[31],
+                        aesd_circular_buffer_find_seq(&buffer, 32)->buffptr);
+  // 2 replaced at the default depth, 8 at depth 20, 16 removed by hand and
+  // 2 replaced at depth 4
+  TEST_ASSERT_EQUAL_UINT64(28, buffer.evicted);
+}